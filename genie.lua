@@ -1,3 +1,14 @@
+newoption({
+  trigger = "precision",
+  value = "P",
+  description = "real number type: double, float, or mixed (float tracing, double hit refinement)",
+  allowed = {
+    {"double", "double everywhere"},
+    {"float", "float everywhere"},
+    {"mixed", "float traversal and intersection, hits placed in double"}
+  }
+})
+
 solution("simple-pt")
 language("C++")
 location(".build")
@@ -24,7 +35,14 @@ configuration("x64")
   targetdir(".build/bin64")
 configuration("vs*")
   defines({'_CRT_SECURE_NO_WARNINGS'})
+configuration("linux")
+  links({'pthread'})
 configuration("")
+if _OPTIONS["precision"] == "float" then
+  defines({"SIMPLE_PT_FLOAT"})
+elseif _OPTIONS["precision"] == "mixed" then
+  defines({"SIMPLE_PT_MIXED"})
+end
 
 project("pugixml")
 kind("StaticLib")
@@ -0,0 +1,853 @@
+#include "bvh.h"
+#include "scheduler.h"
+#include "simd.h"
+#include <string.h>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+static const int    BVH_BINS = 16;
+static const int    BVH_MAX_LEAF_SIZE = 4;
+static const int    BVH_MAX_SAH_DEPTH = 40;
+static const int    BVH_STACK_SIZE = 64;
+static const real_t BVH_TRAVERSAL_COST = real_t(1);
+static const int    BVH_REFIT_TASKS_PER_THREAD = 8;
+
+bool parseBvhBuild(char const *name, bvh_build_t *quality) {
+  static struct {
+    char const *name;
+    bvh_build_t quality;
+  } const qualities[] = {
+    {"sah", BVH_BUILD_SAH},
+    {"lbvh", BVH_BUILD_LINEAR},
+    {"sbvh", BVH_BUILD_SPATIAL},
+  };
+  for (auto const &q : qualities) {
+    if (!strcmp(name, q.name)) {
+      *quality = q.quality;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool findSahSplit(std::vector<bvh_ref_t> const &refs, int begin, int end,
+                  aabb_t const &bounds, aabb_t const &cbounds, int *axis,
+                  real_t *pos, real_t *split_cost) {
+  int const    count = end - begin;
+  real_t       best = real_t(count); // cost of making a leaf
+  bool         found = false;
+  real_t const inv_area = real_t(1) / std::max(area(bounds), real_t(1e-12));
+
+  for (int a = 0; a < 3; ++a) {
+    real_t const lo = axisOf(cbounds.min, a);
+    real_t const hi = axisOf(cbounds.max, a);
+    if (hi - lo <= real_t(0)) {
+      continue;
+    }
+    aabb_t bin_bounds[BVH_BINS];
+    int    bin_count[BVH_BINS] = {0};
+    real_t const scale = real_t(BVH_BINS) / (hi - lo);
+    for (int i = begin; i < end; ++i) {
+      int b = int((axisOf(refs[i].center, a) - lo) * scale);
+      b = std::min(std::max(b, 0), BVH_BINS - 1);
+      ++bin_count[b];
+      bin_bounds[b] = merge(bin_bounds[b], refs[i].bounds);
+    }
+
+    // sweep from the right to get the cost of every right hand side
+    real_t right_cost[BVH_BINS];
+    aabb_t acc;
+    int    n = 0;
+    for (int b = BVH_BINS - 1; b > 0; --b) {
+      acc = merge(acc, bin_bounds[b]);
+      n += bin_count[b];
+      right_cost[b] = area(acc) * n;
+    }
+    acc = aabb_t();
+    n = 0;
+    for (int b = 0; b < BVH_BINS - 1; ++b) {
+      acc = merge(acc, bin_bounds[b]);
+      n += bin_count[b];
+      if (n == 0 || n == count) {
+        continue;
+      }
+      real_t const cost = BVH_TRAVERSAL_COST +
+                          (area(acc) * n + right_cost[b + 1]) * inv_area;
+      if (cost < best) {
+        best = cost;
+        found = true;
+        *axis = a;
+        *pos = lo + real_t(b + 1) / scale;
+      }
+    }
+  }
+  if (split_cost) {
+    *split_cost = best;
+  }
+  return found;
+}
+
+static int buildNode(std::vector<bvh_ref_t> &refs, int begin, int end,
+                     int depth, BVH *bvh) {
+  int const index = int(bvh->nodes.size());
+  bvh->nodes.push_back(bvh_node_t());
+
+  aabb_t bounds, cbounds;
+  for (int i = begin; i < end; ++i) {
+    bounds = merge(bounds, refs[i].bounds);
+    cbounds = merge(cbounds, refs[i].center);
+  }
+  bvh->nodes[index].bounds = bounds;
+
+  int const count = end - begin;
+  int       mid = begin;
+  int       axis = 0;
+  real_t    pos = real_t(0);
+  bool      split = count > 1 && depth < BVH_MAX_SAH_DEPTH &&
+                    findSahSplit(refs, begin, end, bounds, cbounds, &axis, &pos);
+  if (split) {
+    mid = int(std::partition(refs.begin() + begin, refs.begin() + end,
+                             [axis, pos](bvh_ref_t const &r) {
+                               return axisOf(r.center, axis) < pos;
+                             }) -
+              refs.begin());
+  } else if (count > BVH_MAX_LEAF_SIZE) {
+    // too many primitives for a leaf, fall back to an object median split
+    vec3_t const d = cbounds.max - cbounds.min;
+    axis = d.x > d.y && d.x > d.z ? 0 : (d.y > d.z ? 1 : 2);
+    mid = begin + count / 2;
+    std::nth_element(refs.begin() + begin, refs.begin() + mid,
+                     refs.begin() + end,
+                     [axis](bvh_ref_t const &a, bvh_ref_t const &b) {
+                       return axisOf(a.center, axis) < axisOf(b.center, axis);
+                     });
+    split = true;
+  }
+
+  if (!split || mid == begin || mid == end) {
+    bvh->nodes[index].offset = int(bvh->primitives.size()); // until BVH::build indexes the leaf
+    bvh->nodes[index].count = count;
+    for (int i = begin; i < end; ++i) {
+      bvh->primitives.push_back(refs[i].geometry);
+    }
+    return index;
+  }
+
+  buildNode(refs, begin, mid, depth + 1, bvh);
+  int const second = buildNode(refs, mid, end, depth + 1, bvh);
+  bvh->nodes[index].offset = second;
+  bvh->nodes[index].count = 0;
+  return index;
+}
+
+/// spatial splits are only tried where the children of the best object split
+/// overlap by more than this part of the root surface
+static const real_t SBVH_MIN_OVERLAP = real_t(1e-5);
+/// references the spatial splits may add, relative to the primitives
+static const real_t SBVH_MAX_DUPLICATES = real_t(0.5);
+
+static void setAxis(vec3_t *v, int axis, real_t value) {
+  (axis == 0 ? v->x : (axis == 1 ? v->y : v->z)) = value;
+}
+
+/// part of ref between lo and hi on axis, false if its geometry does not
+/// reach in there
+static bool clipRef(bvh_ref_t const &ref, int axis, real_t lo, real_t hi,
+                    bvh_ref_t *part) {
+  aabb_t box = ref.bounds;
+  setAxis(&box.min, axis, std::max(axisOf(box.min, axis), lo));
+  setAxis(&box.max, axis, std::min(axisOf(box.max, axis), hi));
+  if (!ref.geometry->clippedBounds(box, &part->bounds)) {
+    return false;
+  }
+  part->center = centroid(part->bounds);
+  part->geometry = ref.geometry;
+  return true;
+}
+
+/// finds a binned spatial split cheaper than split_cost that adds at most
+/// budget references. references are counted in the bins where they enter
+/// and leave, and their bounds are cut at the bin planes in between. the
+/// geometry itself is only clipped by spatialPartition(), once a split is
+/// chosen, as clipping it in every bin costs ten times the build time.
+static bool findSpatialSplit(std::vector<bvh_ref_t> const &refs,
+                             aabb_t const &bounds, int budget, int *axis,
+                             real_t *pos, real_t *split_cost) {
+  int const    count = int(refs.size());
+  bool         found = false;
+  real_t const inv_area = real_t(1) / std::max(area(bounds), real_t(1e-12));
+
+  for (int a = 0; a < 3; ++a) {
+    real_t const lo = axisOf(bounds.min, a);
+    real_t const hi = axisOf(bounds.max, a);
+    if (hi - lo <= real_t(0)) {
+      continue;
+    }
+    aabb_t bin_bounds[BVH_BINS];
+    int    enter[BVH_BINS] = {0};
+    int    leave[BVH_BINS] = {0};
+    real_t const width = (hi - lo) / real_t(BVH_BINS);
+    for (bvh_ref_t const &ref : refs) {
+      int const first = std::min(std::max(int((axisOf(ref.bounds.min, a) - lo) / width), 0), BVH_BINS - 1);
+      int const last = std::min(std::max(int((axisOf(ref.bounds.max, a) - lo) / width), first), BVH_BINS - 1);
+      ++enter[first];
+      ++leave[last];
+      if (first == last) {
+        bin_bounds[first] = merge(bin_bounds[first], ref.bounds);
+        continue;
+      }
+      for (int b = first; b <= last; ++b) {
+        aabb_t part = ref.bounds;
+        if (b != first) {
+          setAxis(&part.min, a, lo + real_t(b) * width);
+        }
+        if (b != last) {
+          setAxis(&part.max, a, lo + real_t(b + 1) * width);
+        }
+        bin_bounds[b] = merge(bin_bounds[b], part);
+      }
+    }
+
+    real_t right_cost[BVH_BINS];
+    int    right_count[BVH_BINS];
+    aabb_t acc;
+    int    n = 0;
+    for (int b = BVH_BINS - 1; b > 0; --b) {
+      acc = merge(acc, bin_bounds[b]);
+      n += leave[b];
+      right_cost[b] = area(acc) * n;
+      right_count[b] = n;
+    }
+    acc = aabb_t();
+    n = 0;
+    for (int b = 0; b < BVH_BINS - 1; ++b) {
+      acc = merge(acc, bin_bounds[b]);
+      n += enter[b];
+      if (n == 0 || right_count[b + 1] == 0 || n + right_count[b + 1] - count > budget) {
+        continue;
+      }
+      real_t const cost = BVH_TRAVERSAL_COST +
+                          (area(acc) * n + right_cost[b + 1]) * inv_area;
+      if (cost < *split_cost) {
+        *split_cost = cost;
+        found = true;
+        *axis = a;
+        *pos = lo + real_t(b + 1) * width;
+      }
+    }
+  }
+  return found;
+}
+
+/// splits refs at pos on axis. references crossing the plane go to both
+/// sides, clipped, unless moving them to one side whole is cheaper.
+static void spatialPartition(std::vector<bvh_ref_t> const &refs, int axis,
+                             real_t pos, std::vector<bvh_ref_t> *left,
+                             std::vector<bvh_ref_t> *right) {
+  real_t const infinity = std::numeric_limits<real_t>::infinity();
+  std::vector<bvh_ref_t> crossing;
+  aabb_t left_bounds, right_bounds;
+  for (bvh_ref_t const &ref : refs) {
+    bvh_ref_t parts[2];
+    if (axisOf(ref.bounds.max, axis) <= pos) {
+      left->push_back(ref);
+      left_bounds = merge(left_bounds, ref.bounds);
+      continue;
+    }
+    if (axisOf(ref.bounds.min, axis) >= pos) {
+      right->push_back(ref);
+      right_bounds = merge(right_bounds, ref.bounds);
+      continue;
+    }
+    bool const l = clipRef(ref, axis, -infinity, pos, &parts[0]);
+    bool const r = clipRef(ref, axis, pos, infinity, &parts[1]);
+    if (l && r) {
+      crossing.push_back(ref);
+      crossing.push_back(parts[0]);
+      crossing.push_back(parts[1]);
+      left_bounds = merge(left_bounds, parts[0].bounds);
+      right_bounds = merge(right_bounds, parts[1].bounds);
+    } else if (r) {
+      right->push_back(parts[1]);
+      right_bounds = merge(right_bounds, parts[1].bounds);
+    } else {
+      left->push_back(l ? parts[0] : ref);
+      left_bounds = merge(left_bounds, left->back().bounds);
+    }
+  }
+
+  int left_count = int(left->size() + crossing.size() / 3);
+  int right_count = int(right->size() + crossing.size() / 3);
+  for (size_t i = 0; i < crossing.size(); i += 3) {
+    bvh_ref_t const &whole = crossing[i];
+    aabb_t const with_left = merge(left_bounds, whole.bounds);
+    aabb_t const with_right = merge(right_bounds, whole.bounds);
+    real_t const split = area(left_bounds) * left_count + area(right_bounds) * right_count;
+    real_t const to_left = area(with_left) * left_count + area(right_bounds) * (right_count - 1);
+    real_t const to_right = area(left_bounds) * (left_count - 1) + area(with_right) * right_count;
+    if (to_left < split && to_left <= to_right) {
+      left->push_back(whole);
+      left_bounds = with_left;
+      --right_count;
+    } else if (to_right < split) {
+      right->push_back(whole);
+      right_bounds = with_right;
+      --left_count;
+    } else {
+      left->push_back(crossing[i + 1]);
+      right->push_back(crossing[i + 2]);
+    }
+  }
+}
+
+/// builds the subtree over refs like buildNode(), but where the children of
+/// the best object split overlap, spatial splits are tried as well. those
+/// add references, as many as budget still allows. refs is left empty.
+static int buildSpatialNode(std::vector<bvh_ref_t> &refs, int depth,
+                            real_t root_area, int *budget, BVH *bvh) {
+  int const index = int(bvh->nodes.size());
+  bvh->nodes.push_back(bvh_node_t());
+
+  aabb_t bounds, cbounds;
+  for (bvh_ref_t const &ref : refs) {
+    bounds = merge(bounds, ref.bounds);
+    cbounds = merge(cbounds, ref.center);
+  }
+  bvh->nodes[index].bounds = bounds;
+
+  int const              count = int(refs.size());
+  std::vector<bvh_ref_t> left, right;
+  bool                   split = false;
+  if (count > 1 && depth < BVH_MAX_SAH_DEPTH) {
+    int    axis = 0;
+    real_t pos = real_t(0);
+    real_t cost = real_t(0);
+    split = findSahSplit(refs, 0, count, bounds, cbounds, &axis, &pos, &cost);
+    aabb_t left_bounds, right_bounds;
+    if (split) {
+      for (bvh_ref_t const &ref : refs) {
+        bool const l = axisOf(ref.center, axis) < pos;
+        (l ? left : right).push_back(ref);
+        (l ? left_bounds : right_bounds) = merge(l ? left_bounds : right_bounds, ref.bounds);
+      }
+    }
+    // without an object split the references overlap as much as they can
+    real_t const overlap_area = split ? area(overlap(left_bounds, right_bounds)) : area(bounds);
+    if (*budget > 0 && overlap_area > SBVH_MIN_OVERLAP * root_area &&
+        findSpatialSplit(refs, bounds, *budget, &axis, &pos, &cost)) {
+      std::vector<bvh_ref_t> spatial_left, spatial_right;
+      spatialPartition(refs, axis, pos, &spatial_left, &spatial_right);
+      if (!spatial_left.empty() && !spatial_right.empty()) {
+        *budget -= int(spatial_left.size() + spatial_right.size()) - count;
+        left.swap(spatial_left);
+        right.swap(spatial_right);
+        split = true;
+      }
+    }
+  }
+  if (!split && count > BVH_MAX_LEAF_SIZE) {
+    // too many primitives for a leaf, fall back to an object median split
+    vec3_t const d = cbounds.max - cbounds.min;
+    int const    axis = d.x > d.y && d.x > d.z ? 0 : (d.y > d.z ? 1 : 2);
+    auto const   mid = refs.begin() + count / 2;
+    std::nth_element(refs.begin(), mid, refs.end(),
+                     [axis](bvh_ref_t const &a, bvh_ref_t const &b) {
+                       return axisOf(a.center, axis) < axisOf(b.center, axis);
+                     });
+    left.assign(refs.begin(), mid);
+    right.assign(mid, refs.end());
+    split = true;
+  }
+
+  if (!split || left.empty() || right.empty()) {
+    bvh->nodes[index].offset = int(bvh->primitives.size()); // until BVH::build indexes the leaf
+    bvh->nodes[index].count = count;
+    for (bvh_ref_t const &ref : refs) {
+      bvh->primitives.push_back(ref.geometry);
+    }
+    refs.clear();
+    return index;
+  }
+
+  std::vector<bvh_ref_t>().swap(refs);
+  buildSpatialNode(left, depth + 1, root_area, budget, bvh);
+  int const second = buildSpatialNode(right, depth + 1, root_area, budget, bvh);
+  bvh->nodes[index].offset = second;
+  bvh->nodes[index].count = 0;
+  return index;
+}
+
+/// keys, refs and radix tree nodes go to the threads in chunks of this size
+static const int LBVH_CHUNK = 4096;
+
+static int countLeadingZeros(uint64_t x) {
+  int n = 0;
+  for (int shift = 32; shift > 0; shift >>= 1) {
+    if ((x >> (64 - shift)) == 0) {
+      n += shift;
+      x <<= shift;
+    }
+  }
+  return x == 0 ? 64 : n;
+}
+
+/// length of the common prefix of the keys of i and j, -1 if j is outside
+static int commonPrefix(std::vector<uint64_t> const &keys, int i, int j) {
+  if (j < 0 || j >= int(keys.size())) {
+    return -1;
+  }
+  return countLeadingZeros(keys[i] ^ keys[j]);
+}
+
+/// stable parallel lsd radix sort of the keys by their upper 32 bits, 8 bits
+/// a pass. every chunk counts its digits, then scatters them behind the same
+/// digits of the chunks before it.
+static void radixSort(std::vector<uint64_t> *keys, int bits, int threads) {
+  int const count = int(keys->size());
+  int const chunks = (count + LBVH_CHUNK - 1) / LBVH_CHUNK;
+  std::vector<uint64_t> sorted(count);
+  std::vector<int>      offsets(chunks * 256);
+  for (int shift = 32; shift < 32 + bits; shift += 8) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+    parallelFor(chunks, threads, [&](int chunk, int) {
+      int *histogram = &offsets[chunk * 256];
+      for (int i = chunk * LBVH_CHUNK; i < std::min(count, (chunk + 1) * LBVH_CHUNK); ++i) {
+        ++histogram[((*keys)[i] >> shift) & 0xff];
+      }
+    });
+    int sum = 0;
+    for (int digit = 0; digit < 256; ++digit) {
+      for (int chunk = 0; chunk < chunks; ++chunk) {
+        int const n = offsets[chunk * 256 + digit];
+        offsets[chunk * 256 + digit] = sum;
+        sum += n;
+      }
+    }
+    parallelFor(chunks, threads, [&](int chunk, int) {
+      int *next = &offsets[chunk * 256];
+      for (int i = chunk * LBVH_CHUNK; i < std::min(count, (chunk + 1) * LBVH_CHUNK); ++i) {
+        sorted[next[((*keys)[i] >> shift) & 0xff]++] = (*keys)[i];
+      }
+    });
+    keys->swap(sorted);
+  }
+}
+
+/// internal node of the binary radix tree: covers the sorted refs
+/// [first, last] and splits them after split
+struct radix_node_t {
+  int first, last, split;
+};
+
+/// reference: Karras, Maximizing Parallelism in the Construction of BVHs,
+/// Octrees, and k-d Trees. internal node i starts or ends at ref i, its
+/// children are the internal nodes split and split + 1. ties of the codes
+/// are broken by the ref index, which is part of the key.
+static radix_node_t radixNode(std::vector<uint64_t> const &keys, int i) {
+  int const d = commonPrefix(keys, i, i + 1) > commonPrefix(keys, i, i - 1) ? 1 : -1;
+  int const min_prefix = commonPrefix(keys, i, i - d);
+  int length = 2;
+  while (commonPrefix(keys, i, i + length * d) > min_prefix) {
+    length *= 2;
+  }
+  int l = 0;
+  for (int t = length / 2; t >= 1; t /= 2) {
+    if (commonPrefix(keys, i, i + (l + t) * d) > min_prefix) {
+      l += t;
+    }
+  }
+  int const j = i + l * d;
+  int const node_prefix = commonPrefix(keys, i, j);
+  int s = 0;
+  for (int t = (l + 1) / 2; ; t = (t + 1) / 2) {
+    if (commonPrefix(keys, i, i + (s + t) * d) > node_prefix) {
+      s += t;
+    }
+    if (t <= 1) {
+      break;
+    }
+  }
+  return radix_node_t{ std::min(i, j), std::max(i, j), i + s * d + std::min(d, 0) };
+}
+
+/// emits the subtree of the sorted refs [first, last] depth first, below
+/// internal node at, collapsing ranges of up to BVH_MAX_LEAF_SIZE into leaves
+static int emitNode(std::vector<bvh_ref_t> const &refs, std::vector<radix_node_t> const &tree,
+                    int first, int last, int at, BVH *bvh) {
+  int const index = int(bvh->nodes.size());
+  bvh->nodes.push_back(bvh_node_t());
+  if (last - first + 1 <= BVH_MAX_LEAF_SIZE) {
+    aabb_t bounds;
+    for (int i = first; i <= last; ++i) {
+      bounds = merge(bounds, refs[i].bounds);
+      bvh->primitives.push_back(refs[i].geometry);
+    }
+    bvh->nodes[index].bounds = bounds;
+    bvh->nodes[index].offset = int(bvh->primitives.size()) - (last - first + 1);
+    bvh->nodes[index].count = last - first + 1;
+    return index;
+  }
+  int const split = tree[at].split;
+  emitNode(refs, tree, first, split, split, bvh);
+  int const second = emitNode(refs, tree, split + 1, last, split + 1, bvh);
+  bvh->nodes[index].bounds = merge(bvh->nodes[index + 1].bounds, bvh->nodes[second].bounds);
+  bvh->nodes[index].offset = second;
+  bvh->nodes[index].count = 0;
+  return index;
+}
+
+/// linear bvh: refs sorted along a morton curve through their centers, the
+/// hierarchy follows the bits of the codes. morton codes, sort and radix
+/// tree run on threads, emitting the nodes is a single pass.
+static void buildLinear(std::vector<bvh_ref_t> const &refs, int threads, BVH *bvh) {
+  int const count = int(refs.size());
+  int const chunks = (count + LBVH_CHUNK - 1) / LBVH_CHUNK;
+  aabb_t cbounds;
+  for (bvh_ref_t const &ref : refs) {
+    cbounds = merge(cbounds, ref.center);
+  }
+  // the ref index in the lower half makes every key unique and, as the sort
+  // is stable, keeps the keys ascending
+  std::vector<uint64_t> keys(count);
+  parallelFor(chunks, threads, [&](int chunk, int) {
+    for (int i = chunk * LBVH_CHUNK; i < std::min(count, (chunk + 1) * LBVH_CHUNK); ++i) {
+      keys[i] = (uint64_t(mortonCode(refs[i].center, cbounds)) << 32) | uint32_t(i);
+    }
+  });
+  radixSort(&keys, 30, threads);
+  std::vector<bvh_ref_t> sorted(count);
+  parallelFor(chunks, threads, [&](int chunk, int) {
+    for (int i = chunk * LBVH_CHUNK; i < std::min(count, (chunk + 1) * LBVH_CHUNK); ++i) {
+      sorted[i] = refs[uint32_t(keys[i])];
+    }
+  });
+
+  std::vector<radix_node_t> tree(std::max(count - 1, 1));
+  parallelFor(std::max(count - 1 + LBVH_CHUNK - 1, 0) / LBVH_CHUNK, threads, [&](int chunk, int) {
+    for (int i = chunk * LBVH_CHUNK; i < std::min(count - 1, (chunk + 1) * LBVH_CHUNK); ++i) {
+      tree[i] = radixNode(keys, i);
+    }
+  });
+  emitNode(sorted, tree, 0, count - 1, 0, bvh);
+}
+
+/// sah cost of the nodes [first, last), with the costs findSahSplit() uses
+static real_t treeCost(BVH const &bvh, int first, int last) {
+  real_t cost = real_t(0);
+  for (int i = first; i < last; ++i) {
+    bvh_node_t const &node = bvh.nodes[i];
+    cost += area(node.bounds) * (node.count > 0 ? real_t(node.count) : BVH_TRAVERSAL_COST);
+  }
+  return cost;
+}
+
+/// total surface of the primitive boxes, what the sah cost of a tree over
+/// them is measured against, so that it stays comparable as they move
+static real_t primitiveArea(BVH const &bvh, int first, int last) {
+  real_t sum = real_t(0);
+  for (int i = first; i < last; ++i) {
+    aabb_t box;
+    bvh.primitives[i]->bounds(&box);
+    sum += area(box);
+  }
+  return sum;
+}
+
+void BVH::build(std::vector<Geometry *> const &geometries, bvh_build_t quality,
+                int threads) {
+  auto const start = std::chrono::high_resolution_clock::now();
+  nodes.clear();
+  primitives.clear();
+  leaves.clear();
+
+  std::vector<bvh_ref_t> refs;
+  refs.reserve(geometries.size());
+  for (Geometry const *g : geometries) {
+    bvh_ref_t ref;
+    if (g->bounds(&ref.bounds)) {
+      ref.center = centroid(ref.bounds);
+      ref.geometry = g;
+      refs.push_back(ref);
+    }
+  }
+  if (!refs.empty()) {
+    nodes.reserve(refs.size() * 2);
+    primitives.reserve(refs.size());
+    if (quality == BVH_BUILD_LINEAR) {
+      buildLinear(refs, threads > 0 ? threads : hardwareThreads(), this);
+    } else if (quality == BVH_BUILD_SPATIAL) {
+      aabb_t root;
+      for (bvh_ref_t const &ref : refs) {
+        root = merge(root, ref.bounds);
+      }
+      int budget = int(real_t(refs.size()) * SBVH_MAX_DUPLICATES);
+      buildSpatialNode(refs, 0, area(root), &budget, this);
+    } else {
+      buildNode(refs, 0, int(refs.size()), 0, this);
+    }
+  }
+
+  // leaves come in primitive order, so every leaf covers a contiguous range
+  // of each type in the compiled arrays
+  soa.build(primitives);
+  int next[GEOMETRY_TYPES] = {0};
+  for (bvh_node_t &node : nodes) {
+    if (node.count == 0) {
+      continue;
+    }
+    bvh_leaf_t leaf;
+    leaf.first = node.offset;
+    for (int t = 0; t < GEOMETRY_TYPES; ++t) {
+      leaf.range.begin[t] = next[t];
+    }
+    for (int i = node.offset; i < node.offset + node.count; ++i) {
+      ++next[primitives[i]->type()];
+    }
+    for (int t = 0; t < GEOMETRY_TYPES; ++t) {
+      leaf.range.end[t] = next[t];
+    }
+    node.offset = int(leaves.size());
+    leaves.push_back(leaf);
+  }
+  real_t const covered = primitiveArea(*this, 0, int(primitives.size()));
+  build_cost = covered > real_t(0) ? treeCost(*this, 0, int(nodes.size())) / covered : real_t(0);
+
+  auto const duration = std::chrono::high_resolution_clock::now() - start;
+  build_time =
+      std::chrono::duration<double, std::milli>(duration).count();
+}
+
+/// one past the last node of the subtree at index, which ends with the
+/// subtree of its last second child
+static int subtreeEnd(std::vector<bvh_node_t> const &nodes, int index) {
+  while (nodes[index].count == 0) {
+    index = nodes[index].offset;
+  }
+  return index + 1;
+}
+
+/// fits the nodes [first, last) to their primitives and children, from the
+/// back, since children follow their parents. returns their sah cost and
+/// adds the surface of the primitive boxes in their leaves to covered.
+static real_t refitNodes(BVH *bvh, int first, int last, real_t *covered) {
+  for (int i = last - 1; i >= first; --i) {
+    bvh_node_t &node = bvh->nodes[i];
+    if (node.count > 0) {
+      int const begin = bvh->leaves[node.offset].first;
+      aabb_t    bounds;
+      for (int p = begin; p < begin + node.count; ++p) {
+        aabb_t box;
+        bvh->primitives[p]->bounds(&box);
+        bounds = merge(bounds, box);
+        *covered += area(box);
+      }
+      node.bounds = bounds;
+    } else {
+      node.bounds = merge(bvh->nodes[i + 1].bounds, bvh->nodes[node.offset].bounds);
+    }
+  }
+  return treeCost(*bvh, first, last);
+}
+
+real_t BVH::refit(int threads) {
+  auto const start = std::chrono::high_resolution_clock::now();
+  if (nodes.empty()) {
+    refit_cost = real_t(1);
+    return refit_cost;
+  }
+  threads = threads > 0 ? threads : hardwareThreads();
+
+  // cut the tree into a few subtrees per thread; the nodes above them are
+  // fit once the subtrees are done
+  std::vector<int> roots(1, 0), above;
+  while (int(roots.size()) < BVH_REFIT_TASKS_PER_THREAD * threads) {
+    std::vector<int> next;
+    for (int root : roots) {
+      if (nodes[root].count > 0) {
+        next.push_back(root);
+      } else {
+        above.push_back(root);
+        next.push_back(root + 1);
+        next.push_back(nodes[root].offset);
+      }
+    }
+    if (next.size() == roots.size()) {
+      break;
+    }
+    roots.swap(next);
+  }
+  std::vector<real_t> costs(roots.size()), areas(roots.size(), real_t(0));
+  parallelFor(int(roots.size()), threads, [&](int i, int) {
+    costs[i] = refitNodes(this, roots[i], subtreeEnd(nodes, roots[i]), &areas[i]);
+  });
+  real_t cost = real_t(0), covered = real_t(0);
+  for (size_t i = 0; i < roots.size(); ++i) {
+    cost += costs[i];
+    covered += areas[i];
+  }
+  for (auto i = above.rbegin(); i != above.rend(); ++i) {
+    cost += refitNodes(this, *i, *i + 1, &covered);
+  }
+  soa.build(primitives);
+
+  auto const duration = std::chrono::high_resolution_clock::now() - start;
+  refit_time = std::chrono::duration<double, std::milli>(duration).count();
+  refit_cost = build_cost > real_t(0) && covered > real_t(0) ? cost / covered / build_cost : real_t(1);
+  return refit_cost;
+}
+
+bool BVH::intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                    long long *visits) const {
+  if (nodes.empty()) {
+    return false;
+  }
+  vec3_t const inv_dir(real_t(1) / ray.direction.x,
+                       real_t(1) / ray.direction.y,
+                       real_t(1) / ray.direction.z);
+  bool found = false;
+
+  struct entry_t {
+    int    node;
+    real_t tnear;
+  } stack[BVH_STACK_SIZE];
+  int       top = 0;
+  long long visited = 1;
+  if (intersectBox(nodes[0].bounds, ray.origin, inv_dir, tmax, &stack[0].tnear)) {
+    stack[top++].node = 0;
+  }
+  while (top > 0) {
+    entry_t const entry = stack[--top];
+    if (entry.tnear >= tmax) {
+      continue;
+    }
+    bvh_node_t const &node = nodes[entry.node];
+    if (node.count > 0) {
+      if (soa.intersect(leaves[node.offset].range, ray, tmax, hit)) {
+        tmax = hit->t;
+        found = true;
+      }
+    } else {
+      // push the farther child first so the nearer one is visited next
+      entry_t closer = {entry.node + 1, real_t(0)};
+      entry_t farther = {node.offset, real_t(0)};
+      bool closer_hit = intersectBox(nodes[closer.node].bounds, ray.origin, inv_dir, tmax, &closer.tnear);
+      bool farther_hit = intersectBox(nodes[farther.node].bounds, ray.origin, inv_dir, tmax, &farther.tnear);
+      visited += 2;
+      if (farther_hit && (!closer_hit || farther.tnear < closer.tnear)) {
+        std::swap(closer, farther);
+        std::swap(closer_hit, farther_hit);
+      }
+      if (farther_hit) {
+        stack[top++] = farther;
+      }
+      if (closer_hit) {
+        stack[top++] = closer;
+      }
+    }
+  }
+  if (visits) {
+    *visits += visited;
+  }
+  return found;
+}
+
+/// whether any lane of the packet enters the box before its closest hit
+static bool intersectBox(aabb_t const &box, ray_packet_t const &packet,
+                         real_t const *inv_dx, real_t const *inv_dy,
+                         real_t const *inv_dz, hit_packet_t const *hits) {
+  vreal_t const minx = vset(box.min.x), miny = vset(box.min.y), minz = vset(box.min.z);
+  vreal_t const maxx = vset(box.max.x), maxy = vset(box.max.y), maxz = vset(box.max.z);
+  for (int i = 0; i < packet.size; i += SIMD_WIDTH) {
+    vreal_t const ox = vload(packet.ox + i), oy = vload(packet.oy + i), oz = vload(packet.oz + i);
+    vreal_t const ix = vload(inv_dx + i), iy = vload(inv_dy + i), iz = vload(inv_dz + i);
+    vreal_t const tx0 = (minx - ox) * ix, tx1 = (maxx - ox) * ix;
+    vreal_t const ty0 = (miny - oy) * iy, ty1 = (maxy - oy) * iy;
+    vreal_t const tz0 = (minz - oz) * iz, tz1 = (maxz - oz) * iz;
+    vreal_t t0 = vset(real_t(0));
+    vreal_t t1 = vload(hits->t + i);
+    t0 = vmax(t0, vmin(tx0, tx1));
+    t1 = vmin(t1, vmax(tx0, tx1));
+    t0 = vmax(t0, vmin(ty0, ty1));
+    t1 = vmin(t1, vmax(ty0, ty1));
+    t0 = vmax(t0, vmin(tz0, tz1));
+    t1 = vmin(t1, vmax(tz0, tz1));
+    if (movemask(t0 <= t1) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void BVH::intersect(ray_packet_t const &packet, hit_packet_t *hits,
+                    long long *visits) const {
+  if (nodes.empty()) {
+    return;
+  }
+  real_t inv_dx[PACKET_MAX_SIZE], inv_dy[PACKET_MAX_SIZE], inv_dz[PACKET_MAX_SIZE];
+  for (int i = 0; i < packet.size; ++i) {
+    inv_dx[i] = real_t(1) / packet.dx[i];
+    inv_dy[i] = real_t(1) / packet.dy[i];
+    inv_dz[i] = real_t(1) / packet.dz[i];
+  }
+  // the packet is coherent, so the first ray decides the visiting order
+  vec3_t const dir(packet.dx[0], packet.dy[0], packet.dz[0]);
+
+  int       stack[BVH_STACK_SIZE];
+  int       top = 0;
+  long long visited = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    int const index = stack[--top];
+    bvh_node_t const &node = nodes[index];
+    ++visited; // one box test for the whole packet
+    if (!intersectBox(node.bounds, packet, inv_dx, inv_dy, inv_dz, hits)) {
+      continue;
+    }
+    if (node.count > 0) {
+      int const first = leaves[node.offset].first;
+      for (int i = first; i < first + node.count; ++i) {
+        primitives[i]->intersect(packet, hits);
+      }
+    } else {
+      int closer = index + 1;
+      int farther = node.offset;
+      if (dot(centroid(nodes[farther].bounds) - centroid(nodes[closer].bounds), dir) < 0) {
+        std::swap(closer, farther);
+      }
+      stack[top++] = farther;
+      stack[top++] = closer;
+    }
+  }
+  if (visits) {
+    *visits += visited;
+  }
+}
+
+bool BVH::occluded(ray_t const &ray, real_t tmin, real_t tmax) const {
+  if (nodes.empty()) {
+    return false;
+  }
+  vec3_t const inv_dir(real_t(1) / ray.direction.x,
+                       real_t(1) / ray.direction.y,
+                       real_t(1) / ray.direction.z);
+  int    stack[BVH_STACK_SIZE];
+  int    top = 0;
+  real_t tnear;
+  stack[top++] = 0;
+  while (top > 0) {
+    bvh_node_t const &node = nodes[stack[--top]];
+    if (!intersectBox(node.bounds, ray.origin, inv_dir, tmax, &tnear)) {
+      continue;
+    }
+    if (node.count > 0) {
+      if (soa.occluded(leaves[node.offset].range, ray, tmin, tmax)) {
+        return true;
+      }
+    } else {
+      stack[top++] = node.offset;
+      stack[top++] = int(&node - nodes.data()) + 1;
+    }
+  }
+  return false;
+}
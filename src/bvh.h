@@ -0,0 +1,84 @@
+#pragma once
+#include "geometry.h"
+#include <vector>
+
+struct bvh_node_t {
+  aabb_t bounds;
+  int    offset; // leaf: index into BVH::leaves, interior: index of the second child
+  int    count;  // number of primitives, 0 for interior nodes
+};
+
+/// how much time the bvh build spends on the quality of the tree
+enum bvh_build_t {
+  BVH_BUILD_SAH,    // binned sah, top down
+  BVH_BUILD_LINEAR, // morton sorted, parallel, for quick previews
+  BVH_BUILD_SPATIAL // binned sah with spatial splits, for large overlapping primitives
+};
+
+/// parses sah, lbvh or sbvh, false for anything else
+bool parseBvhBuild(char const *name, bvh_build_t *quality);
+
+/// primitive as the builders see it
+struct bvh_ref_t {
+  aabb_t          bounds;
+  vec3_t          center;
+  Geometry const *geometry;
+};
+
+/// finds the cheapest binned SAH split of refs [begin, end) with the given
+/// bounds and bounds of the centers, false if a leaf is cheaper. split_cost
+/// gets the cost of the split, or of the leaf, relative to a primitive test.
+bool findSahSplit(std::vector<bvh_ref_t> const &refs, int begin, int end,
+                  aabb_t const &bounds, aabb_t const &cbounds, int *axis,
+                  real_t *pos, real_t *split_cost = nullptr);
+
+/// slab test against [0, tmax], returns the entry distance
+inline bool intersectBox(aabb_t const &box, vec3_t const &origin,
+                        vec3_t const &inv_dir, real_t tmax, real_t *tnear) {
+  *tnear = real_t(0);
+  return clipToBox(box, origin, inv_dir, tnear, &tmax);
+}
+
+/// primitives of a leaf, as pointers and in the compiled arrays
+struct bvh_leaf_t {
+  int         first; // first primitive
+  soa_range_t range; // per type range in BVH::soa
+};
+
+/// bounding volume hierarchy over bounded geometries, built with binned SAH,
+/// binned SAH with spatial splits or as a linear bvh. spatial splits put
+/// primitives crossing the split plane in both children, so they can appear
+/// in more than one leaf.
+/// nodes are stored depth first, the first child of an interior node directly
+/// follows its parent. single rays test leaves against the compiled soa
+/// arrays, packets use the primitives themselves.
+class BVH {
+public:
+  /// threads only matter to the linear build, 0 for all hardware threads
+  void build(std::vector<Geometry *> const &geometries,
+             bvh_build_t quality = BVH_BUILD_SAH, int threads = 0);
+  /// finds the closest hit closer than tmax, hit is untouched on a miss.
+  /// adds the number of node boxes tested to visits if given.
+  bool intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                 long long *visits = nullptr) const;
+  /// closest hits of a coherent packet, same results as intersect() per lane.
+  /// adds the number of node boxes tested, once per packet, to visits.
+  void intersect(ray_packet_t const &packet, hit_packet_t *hits,
+                 long long *visits = nullptr) const;
+  /// any hit in [tmin, tmax], stops at the first one found
+  bool occluded(ray_t const &ray, real_t tmin, real_t tmax) const;
+  /// fits the boxes to primitives that moved, keeping the tree, on threads
+  /// threads, 0 for all hardware threads. returns the sah cost of the fit
+  /// tree over its cost right after build(), which grows as the motion
+  /// leaves the tree less suited to the scene.
+  real_t refit(int threads = 0);
+
+  std::vector<bvh_node_t>       nodes;
+  std::vector<Geometry const *> primitives; // leaf order, repeated by spatial splits
+  std::vector<bvh_leaf_t>       leaves;
+  GeometrySoA                   soa; // primitives in leaf order
+  double                        build_time = 0; // milliseconds
+  double                        refit_time = 0; // milliseconds, of the last refit()
+  real_t                        refit_cost = 1; // what the last refit() returned
+  real_t                        build_cost = 0; // sah cost over the primitives' box surface
+};
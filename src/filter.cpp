@@ -0,0 +1,81 @@
+#include "filter.h"
+#include <string.h>
+
+bool parseFilterType(char const *name, filter_type_t *type) {
+  static struct {
+    char const   *name;
+    filter_type_t type;
+  } const types[] = {
+    {"box", FILTER_BOX},
+    {"tent", FILTER_TENT},
+    {"gaussian", FILTER_GAUSSIAN},
+    {"blackman-harris", FILTER_BLACKMAN_HARRIS},
+  };
+  for (auto const &t : types) {
+    if (!strcmp(name, t.name)) {
+      *type = t.type;
+      return true;
+    }
+  }
+  return false;
+}
+
+static const int FILTER_TABLE_SIZE = 256;
+
+static real_t filterRadius(filter_type_t type) {
+  switch (type) {
+  case FILTER_TENT:
+    return real_t(1);
+  case FILTER_GAUSSIAN:
+    return real_t(1.5);
+  case FILTER_BLACKMAN_HARRIS:
+    return real_t(2);
+  default:
+    return real_t(0.5);
+  }
+}
+
+/// one axis of the filter at x in [-radius, radius]
+static real_t evaluate(filter_type_t type, real_t x, real_t radius) {
+  switch (type) {
+  case FILTER_TENT:
+    return std::max(real_t(0), radius - std::abs(x));
+  case FILTER_GAUSSIAN: {
+    real_t const alpha = real_t(2);
+    return std::max(real_t(0), std::exp(-alpha * x * x) - std::exp(-alpha * radius * radius));
+  }
+  case FILTER_BLACKMAN_HARRIS: {
+    real_t const t = real_t(2) * PI * (x / radius + real_t(1)) * real_t(0.5);
+    return real_t(0.35875) - real_t(0.48829) * std::cos(t) + real_t(0.14128) * std::cos(real_t(2) * t) -
+           real_t(0.01168) * std::cos(real_t(3) * t);
+  }
+  default:
+    return real_t(1);
+  }
+}
+
+Filter::Filter(filter_type_t type) : radius(filterRadius(type)) {
+  // piecewise constant in FILTER_TABLE_SIZE steps, evaluated at their centers
+  cdf.resize(FILTER_TABLE_SIZE + 1);
+  cdf[0] = real_t(0);
+  real_t const step = real_t(2) * radius / real_t(FILTER_TABLE_SIZE);
+  for (int i = 0; i < FILTER_TABLE_SIZE; ++i) {
+    cdf[i + 1] = cdf[i] + evaluate(type, -radius + (real_t(i) + real_t(0.5)) * step, radius);
+  }
+  for (real_t &c : cdf) {
+    c /= cdf.back();
+  }
+}
+
+real_t Filter::warp(real_t u) const {
+  int const i = std::min(int(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()) - 1,
+                         FILTER_TABLE_SIZE - 1);
+  real_t const width = cdf[i + 1] - cdf[i];
+  real_t const t = width > real_t(0) ? (u - cdf[i]) / width : real_t(0.5);
+  return -radius + (real_t(i) + t) * (real_t(2) * radius / real_t(FILTER_TABLE_SIZE));
+}
+
+void Filter::sample(real_t u, real_t v, real_t *dx, real_t *dy) const {
+  *dx = warp(u);
+  *dy = warp(v);
+}
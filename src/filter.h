@@ -0,0 +1,32 @@
+#pragma once
+#include "math.h"
+#include <vector>
+
+enum filter_type_t {
+  FILTER_BOX,            // radius 0.5, plain jittered pixel area
+  FILTER_TENT,           // radius 1
+  FILTER_GAUSSIAN,       // radius 1.5, alpha 2, shifted to 0 at the radius
+  FILTER_BLACKMAN_HARRIS // radius 2
+};
+
+/// parses box, tent, gaussian or blackman-harris, false for anything else
+bool parseFilterType(char const *name, filter_type_t *type);
+
+/// separable pixel reconstruction filter, applied by importance sampling:
+/// sample offsets are distributed like the filter, so every sample is simply
+/// averaged into its own pixel. all filters are non-negative, so this needs
+/// no weights and no splatting into neighbouring pixels.
+class Filter {
+public:
+  explicit Filter(filter_type_t type);
+
+  /// offset from the pixel center, in pixels, for uniform u, v
+  void sample(real_t u, real_t v, real_t *dx, real_t *dy) const;
+
+private:
+  /// one axis, through the tabulated inverse cdf
+  real_t warp(real_t u) const;
+
+  real_t              radius;
+  std::vector<real_t> cdf; // of the filter over [-radius, radius], ends at 1
+};
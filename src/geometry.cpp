@@ -1,113 +1,241 @@
 #include "geometry.h"
+#include "simd.h"
 #include <limits>
 #include <algorithm>
 
-/// reference: http://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-sphere-intersection
-bool Sphere::intersect(ray_t const& ray, intersection_t *intersection) const {
-  if (!intersection) {
-    return false;
+// taken from unreal engine
+void Geometry::surface(ray_t const &ray, real_t t,
+                       intersection_t *intersection) const {
+#if defined(SIMPLE_PT_MIXED)
+  // t comes from float traversal, place the hit in double so the position
+  // sits on the surface up to float rounding
+  rayd_t const rayd = {vec3d_t(ray.origin), vec3d_t(ray.direction)};
+  double const td = refine(rayd, double(t));
+  intersection->position = vec3_t(rayd.origin + rayd.direction * td);
+#else
+  intersection->position = ray.origin + ray.direction * t;
+#endif
+  intersection->normal = surfaceNormal(intersection->position);
+  intersection->material = material;
+  vec3_t const &n = intersection->normal;
+  if (lengthSquare(n) == real_t(0)) {
+    intersection->tangent = intersection->bitangent = n;
+    return;
   }
+  vec3_t const up = std::abs(n.z) < 0.999 ? vec3_t(0, 0, 1) : vec3_t(1, 0, 0);
+  intersection->tangent = normalize(cross(up, n));
+  intersection->bitangent = cross(n, intersection->tangent);
+}
 
+/// reference: http://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-sphere-intersection
+bool Sphere::intersect(ray_t const& ray, real_t tmax, real_t *t) const {
   vec3_t diff = ray.origin - center;
   real_t a0 = lengthSquare(diff) - radius*radius;
   real_t a1 = dot(ray.direction, diff);
   real_t discr = a1*a1-a0;
   if (discr < real_t(0)) {
-    intersection->num = 0;
+    return false;
+  }
+  if (std::fabs(a0) < 1e-5) { // on the surface
     return false;
   }
 
-  real_t t[2] = { real_t(0), real_t(0) };
+  real_t const root = std::sqrt(discr);
+  real_t t0 = -a1 - root;
+  if (a0 < real_t(0) || t0 < real_t(0)) {
+    // ray starts inside the sphere, or the first root is behind it
+    t0 = -a1 + root;
+  }
+  if (t0 < real_t(0) || t0 >= tmax) {
+    return false;
+  }
+  *t = t0;
+  return true;
+}
 
-  if (std::fabs(a0) < 1e-5) { // on the surface
-    intersection->num = 0;
-    return false;
-  }
-  if (a0 < real_t(0)) {
-    // ray starts inside the sphere
-    intersection->num = 1;
-    real_t root = std::sqrt(discr);
-    t[0] = -a1 + root;
-  } else if (discr > real_t(0)) {
-    intersection->num = 2;
-    real_t root = std::sqrt(discr);
-    t[0] = -a1 - root;
-    t[1] = -a1 + root;
-  } else { // discr == 0
-    intersection->num = 1;
-    t[0] = -a1;
-  }
-
-  if (intersection->num > 0) {
-    if (t[0] < 0 && intersection->num > 1) {
-      --intersection->num;
-      t[0] = t[1];
-    }
-    if (t[0] < 0) {
-      intersection->num = 0;
-      return false;
+/// writes t and id for the lanes [lane, lane + SIMD_WIDTH) not in miss
+static void storeHits(vmask_t miss, vreal_t t, int lane, int id,
+                      hit_packet_t *hits) {
+  vmask_t const hit = andnot(vall(), miss);
+  int const bits = movemask(hit);
+  if (bits == 0) {
+    return;
+  }
+  vstore(hits->t + lane, select(hit, t, vload(hits->t + lane)));
+  for (int i = 0; i < SIMD_WIDTH; ++i) {
+    if (bits & (1 << i)) {
+      hits->id[lane + i] = id;
     }
-    intersection->intersection[0] = ray.origin + ray.direction * t[0];
-    intersection->normal[0] = normalize(intersection->intersection[0] - center);
-    if (intersection->num > 1) {
-      intersection->intersection[1] = ray.origin + ray.direction * t[1];
-      intersection->normal[1] = normalize(intersection->intersection[1] - center);
+  }
+}
+
+// each packet kernel below is the scalar intersect() above, operation for
+// operation, so both give the same bits
+void Sphere::intersect(ray_packet_t const &packet, hit_packet_t *hits) const {
+  vreal_t const cx = vset(center.x), cy = vset(center.y), cz = vset(center.z);
+  vreal_t const r2 = vset(radius*radius);
+  vreal_t const zero = vset(real_t(0));
+  for (int i = 0; i < packet.size; i += SIMD_WIDTH) {
+    vreal_t const diffx = vload(packet.ox + i) - cx;
+    vreal_t const diffy = vload(packet.oy + i) - cy;
+    vreal_t const diffz = vload(packet.oz + i) - cz;
+    vreal_t const a0 = (diffx*diffx + diffy*diffy + diffz*diffz) - r2;
+    vreal_t const a1 = vload(packet.dx + i)*diffx + vload(packet.dy + i)*diffy +
+                       vload(packet.dz + i)*diffz;
+    vreal_t const discr = a1*a1 - a0;
+    vmask_t miss = (discr < zero) | (vabs(a0) < vset(real_t(1e-5)));
+    if (movemask(miss) == (1 << SIMD_WIDTH) - 1) {
+      continue;
     }
-    intersection->material = &material;
-    return true;
-  } else {
-    return false;
+    vreal_t const root = vsqrt(discr);
+    vreal_t t0 = -a1 - root;
+    t0 = select((a0 < zero) | (t0 < zero), -a1 + root, t0);
+    vreal_t const tmax = vload(hits->t + i);
+    miss = miss | (t0 < zero) | (t0 >= tmax);
+    storeHits(miss, t0, i, id, hits);
   }
 }
 
-/// reference: http://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-plane-and-ray-disk-intersection
-bool Plane::intersect(ray_t const& ray, intersection_t *intersection) const {
-  if (!intersection) {
+bool Sphere::occluded(ray_t const &ray, real_t tmin, real_t tmax) const {
+  vec3_t const diff = ray.origin - center;
+  real_t const a0 = lengthSquare(diff) - radius*radius;
+  real_t const a1 = dot(ray.direction, diff);
+  real_t const discr = a1*a1 - a0;
+  if (discr < real_t(0)) {
     return false;
   }
+  real_t const root = std::sqrt(discr);
+  real_t const t0 = -a1 - root;
+  real_t const t1 = -a1 + root;
+  return (t0 >= tmin && t0 <= tmax) || (t1 >= tmin && t1 <= tmax);
+}
+
+vec3_t Sphere::surfaceNormal(vec3_t const &position) const {
+  return normalize(position - center);
+}
+
+/// the root closest to t
+double Sphere::refine(rayd_t const &ray, double t) const {
+  vec3d_t const diff = ray.origin - vec3d_t(center);
+  double const a0 = lengthSquare(diff) - double(radius)*double(radius);
+  double const a1 = dot(ray.direction, diff);
+  double const root = std::sqrt(std::max(a1*a1 - a0, 0.0));
+  double const t0 = -a1 - root;
+  double const t1 = -a1 + root;
+  return std::abs(t0 - t) <= std::abs(t1 - t) ? t0 : t1;
+}
+
+/// reference: http://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-plane-and-ray-disk-intersection
+static bool intersectPlane(vec3_t const &center, vec3_t const &normal,
+                           ray_t const &ray, real_t *t) {
   real_t denom = dot(normal, ray.direction);
-  real_t t = real_t(0);
-  if (std::abs(denom) > real_t(1.0e-6)) {
-    real_t const dist_to_origin = dot(normal, center);
-    real_t const dist_to_ray_origin = dot(normal, ray.origin) - dist_to_origin;
-    t = -dist_to_ray_origin / denom;
-  }
-  if (t <= 1e-5) {
-    intersection->num = 0;
+  if (std::abs(denom) <= real_t(1.0e-6)) {
     return false;
   }
-  vec3_t p = ray.origin + ray.direction*t;
+  real_t const dist_to_origin = dot(normal, center);
+  real_t const dist_to_ray_origin = dot(normal, ray.origin) - dist_to_origin;
+  *t = -dist_to_ray_origin / denom;
+  return true;
+}
 
-  intersection->num = 1;
-  intersection->intersection[0] = p;
-  intersection->normal[0] = normal;
-  intersection->material = &material;
+bool Plane::intersect(ray_t const& ray, real_t tmax, real_t *t) const {
+  real_t t0;
+  if (!intersectPlane(center, normal, ray, &t0) || t0 <= 1e-5 || t0 >= tmax) {
+    return false;
+  }
+  *t = t0;
   return true;
 }
 
-bool Disk::intersect(ray_t const &ray, intersection_t *intersection) const {
+/// packet version of intersectPlane(), sets miss for parallel lanes
+static vreal_t intersectPlane(vec3_t const &center, vec3_t const &normal,
+                              ray_packet_t const &packet, int i,
+                              vmask_t *miss) {
+  vreal_t const denom = vset(normal.x)*vload(packet.dx + i) +
+                        vset(normal.y)*vload(packet.dy + i) +
+                        vset(normal.z)*vload(packet.dz + i);
+  *miss = vabs(denom) <= vset(real_t(1.0e-6));
+  vreal_t const dist_to_origin = vset(dot(normal, center));
+  vreal_t const dist_to_ray_origin =
+      (vset(normal.x)*vload(packet.ox + i) + vset(normal.y)*vload(packet.oy + i) +
+       vset(normal.z)*vload(packet.oz + i)) - dist_to_origin;
+  return -dist_to_ray_origin / denom;
+}
+
+void Plane::intersect(ray_packet_t const &packet, hit_packet_t *hits) const {
+  for (int i = 0; i < packet.size; i += SIMD_WIDTH) {
+    vmask_t miss;
+    vreal_t const t = intersectPlane(center, normal, packet, i, &miss);
+    miss = miss | (t <= vset(real_t(1e-5))) | (t >= vload(hits->t + i));
+    storeHits(miss, t, i, id, hits);
+  }
+}
+
+bool Plane::occluded(ray_t const &ray, real_t tmin, real_t tmax) const {
+  real_t t;
+  return intersectPlane(center, normal, ray, &t) && t >= tmin && t <= tmax;
+}
+
+vec3_t Plane::surfaceNormal(vec3_t const &) const {
+  return normal;
+}
+
+double Plane::refine(rayd_t const &ray, double t) const {
+  vec3d_t const n(normal);
+  double const denom = dot(n, ray.direction);
+  if (denom == 0.0) {
+    return t;
+  }
+  return -(dot(n, ray.origin) - dot(n, vec3d_t(center))) / denom;
+}
+
+bool Disk::intersect(ray_t const &ray, real_t tmax, real_t *t) const {
   // intersect plane:
-  if (!this->Plane::intersect(ray, intersection)) {
+  real_t t0;
+  if (!this->Plane::intersect(ray, tmax, &t0)) {
     return false;
   }
-  vec3_t d = intersection->intersection[0] - center;
+  vec3_t d = ray.origin + ray.direction * t0 - center;
   if (dot(d,d) > radius*radius) {
-    intersection->num = 0;
     return false;
   }
+  *t = t0;
   return true;
 }
 
+void Disk::intersect(ray_packet_t const &packet, hit_packet_t *hits) const {
+  for (int i = 0; i < packet.size; i += SIMD_WIDTH) {
+    vmask_t miss;
+    vreal_t const t = intersectPlane(center, normal, packet, i, &miss);
+    miss = miss | (t <= vset(real_t(1e-5))) | (t >= vload(hits->t + i));
+    if (movemask(miss) == (1 << SIMD_WIDTH) - 1) {
+      continue;
+    }
+    vreal_t const dx = (vload(packet.ox + i) + vload(packet.dx + i)*t) - vset(center.x);
+    vreal_t const dy = (vload(packet.oy + i) + vload(packet.dy + i)*t) - vset(center.y);
+    vreal_t const dz = (vload(packet.oz + i) + vload(packet.dz + i)*t) - vset(center.z);
+    miss = miss | ((dx*dx + dy*dy + dz*dz) > vset(radius*radius));
+    storeHits(miss, t, i, id, hits);
+  }
+}
+
+bool Disk::occluded(ray_t const &ray, real_t tmin, real_t tmax) const {
+  real_t t;
+  if (!intersectPlane(center, normal, ray, &t) || t < tmin || t > tmax) {
+    return false;
+  }
+  vec3_t d = ray.origin + ray.direction * t - center;
+  return dot(d,d) <= radius*radius;
+}
+
 // reference: GTEngine
-static bool clip(real_t denom, real_t numer, vec3_t const& n0, vec3_t const& n1,
-                 real_t *t0, real_t *t1, vec3_t *on0, vec3_t *on1) {
+static bool clip(real_t denom, real_t numer, real_t *t0, real_t *t1) {
   if (denom > real_t(0)) {
     if (numer > denom * *t1) {
       return false;
     }
     if (numer > denom * *t0) {
       *t0 = numer / denom;
-      *on0 = n0;
     }
     return true;
   } else if (denom < real_t(0)) {
@@ -116,7 +244,6 @@ static bool clip(real_t denom, real_t numer, vec3_t const& n0, vec3_t const& n1,
     }
     if (numer > denom * *t1) {
       *t1 = numer / denom;
-      *on1 = n1;
     }
     return true;
   } else {
@@ -126,7 +253,17 @@ static bool clip(real_t denom, real_t numer, vec3_t const& n0, vec3_t const& n1,
 
 /// reference: GTEngine
 /// reference: http://www.opengl-tutorial.org/cn/miscellaneous/clicking-on-objects/picking-with-custom-ray-obb-function/
-bool OrientedBox::intersect(ray_t const& ray, intersection_t *intersection) const {
+static bool clipBox(vec3_t const &origin, vec3_t const &direction,
+                    vec3_t const &extent, real_t *t0, real_t *t1) {
+  return clip( direction.x, -origin.x - extent.x, t0, t1) &&
+         clip(-direction.x,  origin.x - extent.x, t0, t1) &&
+         clip( direction.y, -origin.y - extent.y, t0, t1) &&
+         clip(-direction.y,  origin.y - extent.y, t0, t1) &&
+         clip( direction.z, -origin.z - extent.z, t0, t1) &&
+         clip(-direction.z,  origin.z - extent.z, t0, t1);
+}
+
+bool OrientedBox::intersect(ray_t const& ray, real_t tmax, real_t *t) const {
   // transform line into oriented-box coordinate system
   vec3_t const diff = ray.origin - center;
   vec3_t const origin = vec3_t( dot(diff, axis[0]),
@@ -139,41 +276,656 @@ bool OrientedBox::intersect(ray_t const& ray, intersection_t *intersection) cons
   if (std::abs(std::abs(origin.x) - extent.x) < 1e-5 ||
       std::abs(std::abs(origin.y) - extent.y) < 1e-5 ||
       std::abs(std::abs(origin.z) - extent.z) < 1e-5) { // ray starts at surface of this
-    intersection->num = 0;
     return false;
   }
   real_t t0 = real_t(0);
+  real_t t1 = tmax; // entering beyond tmax fails the clip early
+  if (!clipBox(origin, direction, extent, &t0, &t1)) {
+    return false;
+  }
+
+  // t0 is clamped to zero, so it is the hit unless the ray is inside the box
+  if (t1 < 0 || t0 >= tmax) {
+    return false;
+  }
+  *t = t0;
+  return true;
+}
+
+static void clip(vreal_t denom, vreal_t numer, vreal_t *t0, vreal_t *t1,
+                 vmask_t *miss) {
+  vreal_t const zero = vset(real_t(0));
+  vmask_t const pos = denom > zero;
+  vmask_t const neg = denom < zero;
+  vreal_t const n0 = denom * *t0;
+  vreal_t const n1 = denom * *t1;
+  vmask_t const fail = (pos & (numer > n1)) | (neg & (numer > n0)) |
+                       andnot(andnot(vall(), pos | neg), numer <= zero);
+  vreal_t const t = numer / denom;
+  *t0 = select(andnot(pos & (numer > n0), fail), t, *t0);
+  *t1 = select(andnot(neg & (numer > n1), fail), t, *t1);
+  *miss = *miss | fail;
+}
+
+void OrientedBox::intersect(ray_packet_t const &packet, hit_packet_t *hits) const {
+  vreal_t const zero = vset(real_t(0));
+  vreal_t const eps = vset(real_t(1e-5));
+  vreal_t ax[3], ay[3], az[3];
+  for (int k = 0; k < 3; ++k) {
+    ax[k] = vset(axis[k].x);
+    ay[k] = vset(axis[k].y);
+    az[k] = vset(axis[k].z);
+  }
+  vreal_t const ex = vset(extent.x), ey = vset(extent.y), ez = vset(extent.z);
+  for (int i = 0; i < packet.size; i += SIMD_WIDTH) {
+    vreal_t const diffx = vload(packet.ox + i) - vset(center.x);
+    vreal_t const diffy = vload(packet.oy + i) - vset(center.y);
+    vreal_t const diffz = vload(packet.oz + i) - vset(center.z);
+    vreal_t const rdx = vload(packet.dx + i);
+    vreal_t const rdy = vload(packet.dy + i);
+    vreal_t const rdz = vload(packet.dz + i);
+    vreal_t const ox = diffx*ax[0] + diffy*ay[0] + diffz*az[0];
+    vreal_t const oy = diffx*ax[1] + diffy*ay[1] + diffz*az[1];
+    vreal_t const oz = diffx*ax[2] + diffy*ay[2] + diffz*az[2];
+    vreal_t const dx = rdx*ax[0] + rdy*ay[0] + rdz*az[0];
+    vreal_t const dy = rdx*ax[1] + rdy*ay[1] + rdz*az[1];
+    vreal_t const dz = rdx*ax[2] + rdy*ay[2] + rdz*az[2];
+
+    vmask_t miss = (vabs(vabs(ox) - ex) < eps) | (vabs(vabs(oy) - ey) < eps) |
+                   (vabs(vabs(oz) - ez) < eps);
+    vreal_t const tmax = vload(hits->t + i);
+    vreal_t t0 = zero;
+    vreal_t t1 = tmax;
+    clip( dx, -ox - ex, &t0, &t1, &miss);
+    clip(-dx,  ox - ex, &t0, &t1, &miss);
+    clip( dy, -oy - ey, &t0, &t1, &miss);
+    clip(-dy,  oy - ey, &t0, &t1, &miss);
+    clip( dz, -oz - ez, &t0, &t1, &miss);
+    clip(-dz,  oz - ez, &t0, &t1, &miss);
+    miss = miss | (t1 < zero) | (t0 >= tmax);
+    storeHits(miss, t0, i, id, hits);
+  }
+}
+
+bool OrientedBox::occluded(ray_t const &ray, real_t tmin, real_t tmax) const {
+  vec3_t const diff = ray.origin - center;
+  vec3_t const origin = vec3_t( dot(diff, axis[0]),
+                                dot(diff, axis[1]),
+                                dot(diff, axis[2]) );
+  vec3_t const direction = vec3_t( dot(ray.direction, axis[0]),
+                                   dot(ray.direction, axis[1]),
+                                   dot(ray.direction, axis[2]) );
+  // unclamped line clip, then check whether entry or exit is in the range
+  real_t t0 = -std::numeric_limits<real_t>::max();
   real_t t1 = std::numeric_limits<real_t>::max();
-  vec3_t n0, n1;
-  bool   lineIntersect = false;
-  if (clip( direction.x, -origin.x - extent.x, -axis[0], axis[0], &t0, &t1, &n0, &n1) &&
-      clip(-direction.x,  origin.x - extent.x, axis[0], -axis[0], &t0, &t1, &n0, &n1) &&
-      clip( direction.y, -origin.y - extent.y, -axis[1], axis[1], &t0, &t1, &n0, &n1) &&
-      clip(-direction.y,  origin.y - extent.y, axis[1], -axis[1], &t0, &t1, &n0, &n1) &&
-      clip( direction.z, -origin.z - extent.z, -axis[2], axis[2], &t0, &t1, &n0, &n1) &&
-      clip(-direction.z,  origin.z - extent.z, axis[2], -axis[2], &t0, &t1, &n0, &n1) ) {
-    lineIntersect = true;
+  if (!clipBox(origin, direction, extent, &t0, &t1)) {
+    return false;
+  }
+  return (t0 >= tmin && t0 <= tmax) || (t1 >= tmin && t1 <= tmax);
+}
+
+/// the face whose plane is closest to the point relative to the box size.
+/// rays that leaked into the box hit it at t = 0, strictly inside; they get a
+/// zero normal, which ends the path.
+vec3_t OrientedBox::surfaceNormal(vec3_t const &position) const {
+  vec3_t const diff = position - center;
+  real_t const px = dot(diff, axis[0]);
+  real_t const py = dot(diff, axis[1]);
+  real_t const pz = dot(diff, axis[2]);
+  if (std::abs(px) < extent.x - 1e-5 && std::abs(py) < extent.y - 1e-5 &&
+      std::abs(pz) < extent.z - 1e-5) {
+    return vec3_t(0, 0, 0);
+  }
+  real_t const rx = std::abs(px / extent.x);
+  real_t const ry = std::abs(py / extent.y);
+  real_t const rz = std::abs(pz / extent.z);
+  if (rx >= ry && rx >= rz) {
+    return px < 0 ? -axis[0] : axis[0];
+  } else if (ry >= rz) {
+    return py < 0 ? -axis[1] : axis[1];
   } else {
-    intersection->num = 0;
+    return pz < 0 ? -axis[2] : axis[2];
+  }
+}
+
+/// the face plane crossed closest to t. a ray that leaked into the box hits
+/// it at exactly 0 and keeps that hit, see surfaceNormal()
+double OrientedBox::refine(rayd_t const &ray, double t) const {
+  if (t == 0.0) {
+    return t;
+  }
+  vec3d_t const diff = ray.origin - vec3d_t(center);
+  double const e[3] = {extent.x, extent.y, extent.z};
+  double best = t;
+  double best_error = std::numeric_limits<double>::max();
+  for (int k = 0; k < 3; ++k) {
+    vec3d_t const a(axis[k]);
+    double const o = dot(diff, a);
+    double const d = dot(ray.direction, a);
+    if (d == 0.0) {
+      continue;
+    }
+    for (double const side : {-e[k], e[k]}) {
+      double const tk = (side - o) / d;
+      if (std::abs(tk - t) < best_error) {
+        best = tk;
+        best_error = std::abs(tk - t);
+      }
+    }
+  }
+  return best;
+}
+
+bool Sphere::bounds(aabb_t *box) const {
+  vec3_t const r(radius, radius, radius);
+  *box = aabb_t(center - r, center + r);
+  return true;
+}
+
+bool Plane::bounds(aabb_t *) const {
+  return false;
+}
+
+/// extent of a disk along each world axis is radius * sin(angle to normal)
+bool Disk::bounds(aabb_t *box) const {
+  vec3_t const &n = normal;
+  vec3_t const r(radius * std::sqrt(std::max(real_t(0), 1 - n.x * n.x)),
+                 radius * std::sqrt(std::max(real_t(0), 1 - n.y * n.y)),
+                 radius * std::sqrt(std::max(real_t(0), 1 - n.z * n.z)));
+  *box = aabb_t(center - r, center + r);
+  return true;
+}
+
+bool OrientedBox::bounds(aabb_t *box) const {
+  vec3_t const r = abs(axis[0]) * extent.x + abs(axis[1]) * extent.y +
+                   abs(axis[2]) * extent.z;
+  *box = aabb_t(center - r, center + r);
+  return true;
+}
+
+bool Geometry::clippedBounds(aabb_t const &box, aabb_t *clipped) const {
+  aabb_t bounds;
+  if (!this->bounds(&bounds)) {
     return false;
   }
+  *clipped = overlap(bounds, box);
+  return !empty(*clipped);
+}
 
-  if (t1 < 0) {
-    intersection->num = 0;
+/// the part inside box is convex, its corners lie on the edges of either box
+/// where they pass through the other one
+bool OrientedBox::clippedBounds(aabb_t const &box, aabb_t *clipped) const {
+  aabb_t whole;
+  bounds(&whole);
+  if (contains(box, whole)) {
+    *clipped = whole;
+    return true;
+  }
+  if (empty(overlap(whole, box))) {
     return false;
   }
-  if (t0 < 0 || t0 == t1) { // t1 >=0
-    intersection->num = 1;
-    intersection->intersection[0] = ray.origin + t1 * ray.direction;
-    intersection->normal[0] = n1;
-  } else { // t0 >=0 && t1 >= 0
-    intersection->num = 2;
-    intersection->intersection[0] = ray.origin + t0 * ray.direction;
-    intersection->intersection[1] = ray.origin + t1 * ray.direction;
-    intersection->normal[0] = n0;
-    intersection->normal[1] = n1;
+  vec3_t const half = (box.max - box.min) * real_t(0.5);
+  vec3_t const mid = centroid(box);
+  aabb_t       part;
+  for (int i = 0; i < 8; ++i) {
+    // edges of this box clipped to box, each from its lower corner
+    vec3_t const corner = center + axis[0] * (i & 1 ? extent.x : -extent.x) +
+                          axis[1] * (i & 2 ? extent.y : -extent.y) +
+                          axis[2] * (i & 4 ? extent.z : -extent.z);
+    for (int a = 0; a < 3; ++a) {
+      if (i & (1 << a)) {
+        continue;
+      }
+      vec3_t const edge = axis[a] * (real_t(2) * axisOf(extent, a));
+      real_t t0 = real_t(0), t1 = real_t(1);
+      if (clipBox(corner - mid, edge, half, &t0, &t1)) {
+        part = merge(merge(part, corner + edge * t0), corner + edge * t1);
+      }
+    }
   }
-  intersection->material = &material;
+  for (int i = 0; i < 8; ++i) {
+    // edges of box clipped to this one, in its coordinates
+    vec3_t const corner(i & 1 ? box.max.x : box.min.x, i & 2 ? box.max.y : box.min.y,
+                        i & 4 ? box.max.z : box.min.z);
+    vec3_t const diff = corner - center;
+    vec3_t const origin(dot(diff, axis[0]), dot(diff, axis[1]), dot(diff, axis[2]));
+    for (int a = 0; a < 3; ++a) {
+      // edges off the bounds of this box can not pass through it
+      int const b = (a + 1) % 3, c = (a + 2) % 3;
+      if ((i & (1 << a)) || axisOf(corner, b) < axisOf(whole.min, b) || axisOf(corner, b) > axisOf(whole.max, b) ||
+          axisOf(corner, c) < axisOf(whole.min, c) || axisOf(corner, c) > axisOf(whole.max, c)) {
+        continue;
+      }
+      real_t const length = axisOf(box.max, a) - axisOf(box.min, a);
+      vec3_t const edge(a == 0 ? length : real_t(0), a == 1 ? length : real_t(0),
+                        a == 2 ? length : real_t(0));
+      vec3_t const direction(dot(edge, axis[0]), dot(edge, axis[1]), dot(edge, axis[2]));
+      real_t t0 = real_t(0), t1 = real_t(1);
+      if (clipBox(origin, direction, extent, &t0, &t1)) {
+        part = merge(merge(part, corner + edge * t0), corner + edge * t1);
+      }
+    }
+  }
+  if (empty(part)) {
+    return false;
+  }
+  // rounding must not cut off any of the surface
+  vec3_t const slack = (box.max - box.min) * real_t(1e-5);
+  *clipped = overlap(aabb_t(part.min - slack, part.max + slack), box);
   return true;
 }
 
+real_t Sphere::area() const {
+  return real_t(4) * PI * radius * radius;
+}
+
+void Sphere::sample(real_t u, real_t v, vec3_t *position,
+                    vec3_t *normal) const {
+  real_t const z = real_t(1) - real_t(2) * u;
+  real_t const r = std::sqrt(std::max(real_t(0), real_t(1) - z * z));
+  real_t const phi = real_t(2) * PI * v;
+  *normal = vec3_t(r * std::cos(phi), r * std::sin(phi), z);
+  *position = center + *normal * radius;
+}
+
+void Sphere::transform(rigid_t const &motion) {
+  center = apply(motion, center);
+}
+
+real_t Plane::area() const {
+  return real_t(0);
+}
+
+void Plane::sample(real_t, real_t, vec3_t *position,
+                   vec3_t *normal) const {
+  *position = center;
+  *normal = this->normal;
+}
+
+void Plane::transform(rigid_t const &motion) {
+  center = apply(motion, center);
+  normal = normalize(rotate(motion, normal));
+}
+
+real_t Disk::area() const {
+  return PI * radius * radius;
+}
+
+void Disk::sample(real_t u, real_t v, vec3_t *position,
+                  vec3_t *normal) const {
+  vec3_t const &n = this->normal;
+  vec3_t const up = std::abs(n.z) < 0.999 ? vec3_t(0, 0, 1) : vec3_t(1, 0, 0);
+  vec3_t const tangent = normalize(cross(up, n));
+  vec3_t const bitangent = cross(n, tangent);
+  real_t const r = radius * std::sqrt(u);
+  real_t const phi = real_t(2) * PI * v;
+  *position = center + tangent * (r * std::cos(phi)) +
+              bitangent * (r * std::sin(phi));
+  *normal = n;
+}
+
+real_t OrientedBox::area() const {
+  return real_t(8) * (extent.y * extent.z + extent.x * extent.z +
+                      extent.x * extent.y);
+}
+
+/// u picks one of the six faces by area and, rescaled, the position along
+/// one of its edges
+void OrientedBox::sample(real_t u, real_t v, vec3_t *position,
+                         vec3_t *normal) const {
+  real_t const e[3] = {extent.x, extent.y, extent.z};
+  real_t const face[3] = {e[1] * e[2], e[0] * e[2], e[0] * e[1]};
+  real_t x = u * real_t(2) * (face[0] + face[1] + face[2]);
+  int    k = 0;
+  while (k < 2 && x >= real_t(2) * face[k]) {
+    x -= real_t(2) * face[k];
+    ++k;
+  }
+  real_t side = real_t(-1);
+  if (x >= face[k]) {
+    x -= face[k];
+    side = real_t(1);
+  }
+  real_t const w = clamp(x / face[k], 0, 1);
+  int const    i = (k + 1) % 3;
+  int const    j = (k + 2) % 3;
+  *normal = axis[k] * side;
+  *position = center + axis[k] * (side * e[k]) +
+              axis[i] * ((real_t(2) * w - real_t(1)) * e[i]) +
+              axis[j] * ((real_t(2) * v - real_t(1)) * e[j]);
+}
+
+void OrientedBox::transform(rigid_t const &motion) {
+  center = apply(motion, center);
+  for (vec3_t &a : axis) {
+    a = normalize(rotate(motion, a));
+  }
+}
+
+// compiled geometry. the kernels below test one ray against SIMD_WIDTH
+// objects of a type at once and follow the scalar intersect() and occluded()
+// operation for operation.
+
+static const int SOA_FULL_MASK = (1 << SIMD_WIDTH) - 1;
+
+/// vector loads at the last objects of a range read up to SIMD_WIDTH - 1
+/// entries past its end
+static void pad(std::vector<real_t> *v) {
+  v->resize(v->size() + SIMD_WIDTH - 1, real_t(0));
+}
+
+void GeometrySoA::build(std::vector<Geometry const *> const &geometries) {
+  spheres = sphere_array_t();
+  planes = plane_array_t();
+  disks = plane_array_t();
+  boxes = box_array_t();
+  for (Geometry const *g : geometries) {
+    switch (g->type()) {
+    case GEOMETRY_SPHERE: {
+      Sphere const *s = static_cast<Sphere const *>(g);
+      spheres.cx.push_back(s->center.x);
+      spheres.cy.push_back(s->center.y);
+      spheres.cz.push_back(s->center.z);
+      spheres.radius2.push_back(s->radius * s->radius);
+      spheres.id.push_back(s->id);
+      break;
+    }
+    case GEOMETRY_PLANE:
+    case GEOMETRY_DISK: {
+      Plane const *p = static_cast<Plane const *>(g);
+      plane_array_t &a = g->type() == GEOMETRY_DISK ? disks : planes;
+      a.cx.push_back(p->center.x);
+      a.cy.push_back(p->center.y);
+      a.cz.push_back(p->center.z);
+      a.nx.push_back(p->normal.x);
+      a.ny.push_back(p->normal.y);
+      a.nz.push_back(p->normal.z);
+      a.dist.push_back(dot(p->normal, p->center));
+      if (g->type() == GEOMETRY_DISK) {
+        real_t const radius = static_cast<Disk const *>(g)->radius;
+        a.radius2.push_back(radius * radius);
+      }
+      a.id.push_back(p->id);
+      break;
+    }
+    case GEOMETRY_ORIENTED_BOX: {
+      OrientedBox const *b = static_cast<OrientedBox const *>(g);
+      boxes.cx.push_back(b->center.x);
+      boxes.cy.push_back(b->center.y);
+      boxes.cz.push_back(b->center.z);
+      for (int k = 0; k < 3; ++k) {
+        boxes.ax[k].push_back(b->axis[k].x);
+        boxes.ay[k].push_back(b->axis[k].y);
+        boxes.az[k].push_back(b->axis[k].z);
+      }
+      boxes.ex.push_back(b->extent.x);
+      boxes.ey.push_back(b->extent.y);
+      boxes.ez.push_back(b->extent.z);
+      boxes.id.push_back(b->id);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  for (std::vector<real_t> *v : {&spheres.cx, &spheres.cy, &spheres.cz, &spheres.radius2}) {
+    pad(v);
+  }
+  for (plane_array_t *a : {&planes, &disks}) {
+    for (std::vector<real_t> *v : {&a->cx, &a->cy, &a->cz, &a->nx, &a->ny, &a->nz, &a->dist, &a->radius2}) {
+      pad(v);
+    }
+  }
+  for (std::vector<real_t> *v : {&boxes.cx, &boxes.cy, &boxes.cz, &boxes.ex, &boxes.ey, &boxes.ez}) {
+    pad(v);
+  }
+  for (int k = 0; k < 3; ++k) {
+    pad(&boxes.ax[k]);
+    pad(&boxes.ay[k]);
+    pad(&boxes.az[k]);
+  }
+}
+
+soa_range_t GeometrySoA::all() const {
+  soa_range_t range = {};
+  range.end[GEOMETRY_SPHERE] = int(spheres.id.size());
+  range.end[GEOMETRY_PLANE] = int(planes.id.size());
+  range.end[GEOMETRY_DISK] = int(disks.id.size());
+  range.end[GEOMETRY_ORIENTED_BOX] = int(boxes.id.size());
+  return range;
+}
+
+/// lanes not in miss hit closer than the tmax they were tested with. they are
+/// taken in order, so ties go to the first object just like a scalar loop.
+static bool takeClosest(vmask_t miss, vreal_t t, int const *ids, real_t *tmax,
+                        hit_t *hit) {
+  int const bits = movemask(andnot(vall(), miss));
+  if (bits == 0) {
+    return false;
+  }
+  real_t ts[SIMD_WIDTH];
+  vstore(ts, t);
+  bool found = false;
+  for (int k = 0; k < SIMD_WIDTH; ++k) {
+    if ((bits & (1 << k)) && ts[k] < *tmax) {
+      *tmax = ts[k];
+      hit->t = ts[k];
+      hit->id = ids[k];
+      found = true;
+    }
+  }
+  return found;
+}
+
+/// broadcast ray, shared by all kernels
+struct soa_ray_t {
+  vreal_t ox, oy, oz;
+  vreal_t dx, dy, dz;
+};
+
+static soa_ray_t broadcast(ray_t const &ray) {
+  return soa_ray_t{vset(ray.origin.x),    vset(ray.origin.y),
+                   vset(ray.origin.z),    vset(ray.direction.x),
+                   vset(ray.direction.y), vset(ray.direction.z)};
+}
+
+/// sphere quadric terms a0, a1 and the discriminant, as in Sphere::intersect()
+static void sphereTerms(GeometrySoA::sphere_array_t const &s, int i,
+                        soa_ray_t const &r, vreal_t *a0, vreal_t *a1,
+                        vreal_t *discr) {
+  vreal_t const diffx = r.ox - vload(s.cx.data() + i);
+  vreal_t const diffy = r.oy - vload(s.cy.data() + i);
+  vreal_t const diffz = r.oz - vload(s.cz.data() + i);
+  *a0 = (diffx*diffx + diffy*diffy + diffz*diffz) - vload(s.radius2.data() + i);
+  *a1 = r.dx*diffx + r.dy*diffy + r.dz*diffz;
+  *discr = *a1 * *a1 - *a0;
+}
+
+static bool intersectSpheres(GeometrySoA::sphere_array_t const &s, int begin,
+                             int end, soa_ray_t const &r, real_t *tmax,
+                             hit_t *hit) {
+  vreal_t const zero = vset(real_t(0));
+  bool found = false;
+  for (int i = begin; i < end; i += SIMD_WIDTH) {
+    vreal_t a0, a1, discr;
+    sphereTerms(s, i, r, &a0, &a1, &discr);
+    vmask_t miss = andnot(vall(), vlanes(end - i)) | (discr < zero) |
+                   (vabs(a0) < vset(real_t(1e-5)));
+    if (movemask(miss) == SOA_FULL_MASK) {
+      continue;
+    }
+    vreal_t const root = vsqrt(discr);
+    vreal_t t0 = -a1 - root;
+    t0 = select((a0 < zero) | (t0 < zero), -a1 + root, t0);
+    miss = miss | (t0 < zero) | (t0 >= vset(*tmax));
+    found = takeClosest(miss, t0, s.id.data() + i, tmax, hit) || found;
+  }
+  return found;
+}
+
+static bool occludedSpheres(GeometrySoA::sphere_array_t const &s, int begin,
+                            int end, soa_ray_t const &r, vreal_t tmin,
+                            vreal_t tmax) {
+  for (int i = begin; i < end; i += SIMD_WIDTH) {
+    vreal_t a0, a1, discr;
+    sphereTerms(s, i, r, &a0, &a1, &discr);
+    vreal_t const root = vsqrt(discr);
+    vreal_t const t0 = -a1 - root;
+    vreal_t const t1 = -a1 + root;
+    vmask_t const hit = ((t0 >= tmin) & (t0 <= tmax)) | ((t1 >= tmin) & (t1 <= tmax));
+    vmask_t const valid = andnot(vlanes(end - i), discr < vset(real_t(0)));
+    if (movemask(hit & valid) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// plane distances as in intersectPlane(), sets miss for parallel lanes
+static vreal_t intersectPlanes(GeometrySoA::plane_array_t const &p, int i,
+                               soa_ray_t const &r, vmask_t *miss) {
+  vreal_t const nx = vload(p.nx.data() + i);
+  vreal_t const ny = vload(p.ny.data() + i);
+  vreal_t const nz = vload(p.nz.data() + i);
+  vreal_t const denom = nx*r.dx + ny*r.dy + nz*r.dz;
+  *miss = vabs(denom) <= vset(real_t(1.0e-6));
+  vreal_t const dist_to_ray_origin = (nx*r.ox + ny*r.oy + nz*r.oz) - vload(p.dist.data() + i);
+  return -dist_to_ray_origin / denom;
+}
+
+/// squared distance of the plane hits at t to the disk centers
+static vreal_t diskDistance2(GeometrySoA::plane_array_t const &p, int i,
+                             soa_ray_t const &r, vreal_t t) {
+  vreal_t const dx = (r.ox + r.dx*t) - vload(p.cx.data() + i);
+  vreal_t const dy = (r.oy + r.dy*t) - vload(p.cy.data() + i);
+  vreal_t const dz = (r.oz + r.dz*t) - vload(p.cz.data() + i);
+  return dx*dx + dy*dy + dz*dz;
+}
+
+static bool intersectPlanes(GeometrySoA::plane_array_t const &p, bool disk,
+                            int begin, int end, soa_ray_t const &r,
+                            real_t *tmax, hit_t *hit) {
+  bool found = false;
+  for (int i = begin; i < end; i += SIMD_WIDTH) {
+    vmask_t miss;
+    vreal_t const t = intersectPlanes(p, i, r, &miss);
+    miss = miss | andnot(vall(), vlanes(end - i)) |
+           (t <= vset(real_t(1e-5))) | (t >= vset(*tmax));
+    if (movemask(miss) == SOA_FULL_MASK) {
+      continue;
+    }
+    if (disk) {
+      miss = miss | (diskDistance2(p, i, r, t) > vload(p.radius2.data() + i));
+    }
+    found = takeClosest(miss, t, p.id.data() + i, tmax, hit) || found;
+  }
+  return found;
+}
+
+static bool occludedPlanes(GeometrySoA::plane_array_t const &p, bool disk,
+                           int begin, int end, soa_ray_t const &r,
+                           vreal_t tmin, vreal_t tmax) {
+  for (int i = begin; i < end; i += SIMD_WIDTH) {
+    vmask_t miss;
+    vreal_t const t = intersectPlanes(p, i, r, &miss);
+    vmask_t hit = andnot(vlanes(end - i), miss) & (t >= tmin) & (t <= tmax);
+    if (disk && movemask(hit) != 0) {
+      hit = hit & (diskDistance2(p, i, r, t) <= vload(p.radius2.data() + i));
+    }
+    if (movemask(hit) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// ray in the frames of the boxes, as in OrientedBox::intersect()
+static void boxFrames(GeometrySoA::box_array_t const &b, int i,
+                      soa_ray_t const &r, vreal_t *o, vreal_t *d) {
+  vreal_t const diffx = r.ox - vload(b.cx.data() + i);
+  vreal_t const diffy = r.oy - vload(b.cy.data() + i);
+  vreal_t const diffz = r.oz - vload(b.cz.data() + i);
+  for (int k = 0; k < 3; ++k) {
+    vreal_t const ax = vload(b.ax[k].data() + i);
+    vreal_t const ay = vload(b.ay[k].data() + i);
+    vreal_t const az = vload(b.az[k].data() + i);
+    o[k] = diffx*ax + diffy*ay + diffz*az;
+    d[k] = r.dx*ax + r.dy*ay + r.dz*az;
+  }
+}
+
+/// all six slabs of clipBox()
+static void clipBoxes(vreal_t const *o, vreal_t const *d, vreal_t const *e,
+                      vreal_t *t0, vreal_t *t1, vmask_t *miss) {
+  for (int k = 0; k < 3; ++k) {
+    clip( d[k], -o[k] - e[k], t0, t1, miss);
+    clip(-d[k],  o[k] - e[k], t0, t1, miss);
+  }
+}
+
+static bool intersectBoxes(GeometrySoA::box_array_t const &b, int begin,
+                           int end, soa_ray_t const &r, real_t *tmax,
+                           hit_t *hit) {
+  vreal_t const zero = vset(real_t(0));
+  vreal_t const eps = vset(real_t(1e-5));
+  bool found = false;
+  for (int i = begin; i < end; i += SIMD_WIDTH) {
+    vreal_t o[3], d[3];
+    boxFrames(b, i, r, o, d);
+    vreal_t const e[3] = {vload(b.ex.data() + i), vload(b.ey.data() + i),
+                          vload(b.ez.data() + i)};
+    vmask_t miss = andnot(vall(), vlanes(end - i)) |
+                   (vabs(vabs(o[0]) - e[0]) < eps) |
+                   (vabs(vabs(o[1]) - e[1]) < eps) |
+                   (vabs(vabs(o[2]) - e[2]) < eps);
+    vreal_t const vtmax = vset(*tmax);
+    vreal_t t0 = zero;
+    vreal_t t1 = vtmax;
+    clipBoxes(o, d, e, &t0, &t1, &miss);
+    miss = miss | (t1 < zero) | (t0 >= vtmax);
+    found = takeClosest(miss, t0, b.id.data() + i, tmax, hit) || found;
+  }
+  return found;
+}
+
+static bool occludedBoxes(GeometrySoA::box_array_t const &b, int begin,
+                          int end, soa_ray_t const &r, vreal_t tmin,
+                          vreal_t tmax) {
+  for (int i = begin; i < end; i += SIMD_WIDTH) {
+    vreal_t o[3], d[3];
+    boxFrames(b, i, r, o, d);
+    vreal_t const e[3] = {vload(b.ex.data() + i), vload(b.ey.data() + i),
+                          vload(b.ez.data() + i)};
+    vmask_t miss = vnone();
+    vreal_t t0 = vset(-std::numeric_limits<real_t>::max());
+    vreal_t t1 = vset(std::numeric_limits<real_t>::max());
+    clipBoxes(o, d, e, &t0, &t1, &miss);
+    vmask_t const hit = ((t0 >= tmin) & (t0 <= tmax)) | ((t1 >= tmin) & (t1 <= tmax));
+    if (movemask(andnot(vlanes(end - i), miss) & hit) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool GeometrySoA::intersect(soa_range_t const &range, ray_t const &ray,
+                            real_t tmax, hit_t *hit) const {
+  soa_ray_t const r = broadcast(ray);
+  bool found = false;
+  found = intersectSpheres(spheres, range.begin[GEOMETRY_SPHERE], range.end[GEOMETRY_SPHERE], r, &tmax, hit) || found;
+  found = intersectPlanes(planes, false, range.begin[GEOMETRY_PLANE], range.end[GEOMETRY_PLANE], r, &tmax, hit) || found;
+  found = intersectPlanes(disks, true, range.begin[GEOMETRY_DISK], range.end[GEOMETRY_DISK], r, &tmax, hit) || found;
+  found = intersectBoxes(boxes, range.begin[GEOMETRY_ORIENTED_BOX], range.end[GEOMETRY_ORIENTED_BOX], r, &tmax, hit) || found;
+  return found;
+}
+
+bool GeometrySoA::occluded(soa_range_t const &range, ray_t const &ray,
+                           real_t tmin, real_t tmax) const {
+  soa_ray_t const r = broadcast(ray);
+  vreal_t const vtmin = vset(tmin), vtmax = vset(tmax);
+  return occludedSpheres(spheres, range.begin[GEOMETRY_SPHERE], range.end[GEOMETRY_SPHERE], r, vtmin, vtmax) ||
+         occludedPlanes(planes, false, range.begin[GEOMETRY_PLANE], range.end[GEOMETRY_PLANE], r, vtmin, vtmax) ||
+         occludedPlanes(disks, true, range.begin[GEOMETRY_DISK], range.end[GEOMETRY_DISK], r, vtmin, vtmax) ||
+         occludedBoxes(boxes, range.begin[GEOMETRY_ORIENTED_BOX], range.end[GEOMETRY_ORIENTED_BOX], r, vtmin, vtmax);
+}
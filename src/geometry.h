@@ -1,32 +1,109 @@
 #pragma once
 #include "math.h"
 #include "material.h"
+#include <vector>
 
-struct ray_t {
-  vec3_t origin;
-  vec3_t direction;
+template <class T>
+struct ray {
+  vec3<T> origin;
+  vec3<T> direction;
 };
 
+typedef ray<real_t> ray_t;
+typedef ray<double> rayd_t;
+
+static const int PACKET_MAX_SIZE = 16;
+
+/// up to PACKET_MAX_SIZE coherent rays in SoA layout. lanes past size are
+/// padding, intersection kernels run on whole SIMD_WIDTH groups of lanes.
+struct ray_packet_t {
+  real_t ox[PACKET_MAX_SIZE], oy[PACKET_MAX_SIZE], oz[PACKET_MAX_SIZE];
+  real_t dx[PACKET_MAX_SIZE], dy[PACKET_MAX_SIZE], dz[PACKET_MAX_SIZE];
+  int    size;
+};
+
+/// closest hit candidate, just enough to decide which hit wins
+struct hit_t {
+  real_t t;  // distance along the ray
+  int    id; // index into Scene::geometry_list
+};
+
+/// per lane closest hit of a ray packet
+struct hit_packet_t {
+  real_t t[PACKET_MAX_SIZE];  // tmax on input, distance of the closest hit
+  int    id[PACKET_MAX_SIZE]; // -1 if nothing was hit
+};
+
+/// surface of the winning hit, reconstructed once from hit_t
 struct intersection_t {
-  vec3_t intersection[2];
-  vec3_t normal[2];
-  int    num;
+  vec3_t position;
+  vec3_t normal;
+  vec3_t tangent;   // shading frame: tangent, bitangent, normal
+  vec3_t bitangent;
   material_t const *material;
 };
 
+enum geometry_type_t {
+  GEOMETRY_SPHERE,
+  GEOMETRY_PLANE,
+  GEOMETRY_DISK,
+  GEOMETRY_ORIENTED_BOX,
+  GEOMETRY_TYPES
+};
+
 class Geometry {
 public:
   virtual ~Geometry() {}
-  virtual bool intersect(ray_t const &ray,
-                         intersection_t *intersection) const = 0;
+  /// finds the nearest hit in (0, tmax), writes its distance to t
+  virtual bool intersect(ray_t const &ray, real_t tmax, real_t *t) const = 0;
+  /// packet version of intersect(), updates the lanes hit before hits->t,
+  /// bit identical to calling intersect() for every lane
+  virtual void intersect(ray_packet_t const &packet,
+                         hit_packet_t *hits) const = 0;
+  /// whether the surface is hit anywhere in [tmin, tmax]
+  virtual bool occluded(ray_t const &ray, real_t tmin, real_t tmax) const = 0;
+  /// surface normal at a point on the surface, zero if there is none
+  virtual vec3_t surfaceNormal(vec3_t const &position) const = 0;
+  /// world space bounds, returns false for unbounded geometry
+  virtual bool bounds(aabb_t *box) const = 0;
+  /// bounds of the part of the surface inside box, false if there is none.
+  /// clips the bounds unless the geometry knows better.
+  virtual bool clippedBounds(aabb_t const &box, aabb_t *clipped) const;
+  virtual geometry_type_t type() const = 0;
+  /// distance of the surface point closest to an approximate hit at t,
+  /// solved again in double
+  virtual double refine(rayd_t const &ray, double t) const = 0;
+  /// surface area, zero for unbounded geometry
+  virtual real_t area() const = 0;
+  /// point and normal uniformly distributed over the surface for uniform u, v
+  virtual void sample(real_t u, real_t v, vec3_t *position,
+                      vec3_t *normal) const = 0;
+  /// moves the surface by motion, see Scene::transform()
+  virtual void transform(rigid_t const &motion) = 0;
 
-  material_t material;
+  /// fills position, normal, shading frame and material of a hit at t
+  void surface(ray_t const &ray, real_t t, intersection_t *intersection) const;
+
+  material_t const *material; // owned by the scene, shared by geometries
+  int               id;       // index into Scene::geometry_list
 };
 
 struct Sphere : public Geometry {
 public:
-  virtual bool intersect(ray_t const &ray,
-                         intersection_t *intersection) const override;
+  virtual bool intersect(ray_t const &ray, real_t tmax,
+                         real_t *t) const override;
+  virtual void intersect(ray_packet_t const &packet,
+                         hit_packet_t *hits) const override;
+  virtual bool occluded(ray_t const &ray, real_t tmin,
+                        real_t tmax) const override;
+  virtual vec3_t surfaceNormal(vec3_t const &position) const override;
+  virtual bool bounds(aabb_t *box) const override;
+  virtual geometry_type_t type() const override { return GEOMETRY_SPHERE; }
+  virtual double refine(rayd_t const &ray, double t) const override;
+  virtual real_t area() const override;
+  virtual void sample(real_t u, real_t v, vec3_t *position,
+                      vec3_t *normal) const override;
+  virtual void transform(rigid_t const &motion) override;
 
   vec3_t center;
   real_t radius;
@@ -34,29 +111,101 @@ public:
 
 class Plane : public Geometry {
 public:
-  virtual bool intersect(ray_t const &ray,
-                         intersection_t *intersection) const override;
+  virtual bool intersect(ray_t const &ray, real_t tmax,
+                         real_t *t) const override;
+  virtual void intersect(ray_packet_t const &packet,
+                         hit_packet_t *hits) const override;
+  virtual bool occluded(ray_t const &ray, real_t tmin,
+                        real_t tmax) const override;
+  virtual vec3_t surfaceNormal(vec3_t const &position) const override;
+  virtual bool bounds(aabb_t *box) const override;
+  virtual geometry_type_t type() const override { return GEOMETRY_PLANE; }
+  virtual double refine(rayd_t const &ray, double t) const override;
+  virtual real_t area() const override;
+  virtual void sample(real_t u, real_t v, vec3_t *position,
+                      vec3_t *normal) const override;
+  virtual void transform(rigid_t const &motion) override;
 
   vec3_t center;
-  vec3_t normal;
+  vec3_t normal; // unit length
 };
 
 class Disk : public Plane {
 public:
-  virtual bool intersect(ray_t const &ray,
-                         intersection_t *intersection) const override;
+  virtual bool intersect(ray_t const &ray, real_t tmax,
+                         real_t *t) const override;
+  virtual void intersect(ray_packet_t const &packet,
+                         hit_packet_t *hits) const override;
+  virtual bool occluded(ray_t const &ray, real_t tmin,
+                        real_t tmax) const override;
+  virtual bool bounds(aabb_t *box) const override;
+  virtual geometry_type_t type() const override { return GEOMETRY_DISK; }
+  virtual real_t area() const override;
+  virtual void sample(real_t u, real_t v, vec3_t *position,
+                      vec3_t *normal) const override;
 
   real_t radius;
 };
 
 class OrientedBox : public Geometry {
 public:
-  virtual bool intersect(ray_t const &ray,
-                         intersection_t *intersection) const override;
+  virtual bool intersect(ray_t const &ray, real_t tmax,
+                         real_t *t) const override;
+  virtual void intersect(ray_packet_t const &packet,
+                         hit_packet_t *hits) const override;
+  virtual bool occluded(ray_t const &ray, real_t tmin,
+                        real_t tmax) const override;
+  virtual vec3_t surfaceNormal(vec3_t const &position) const override;
+  virtual bool bounds(aabb_t *box) const override;
+  virtual bool clippedBounds(aabb_t const &box, aabb_t *clipped) const override;
+  virtual geometry_type_t type() const override { return GEOMETRY_ORIENTED_BOX; }
+  virtual double refine(rayd_t const &ray, double t) const override;
+  virtual real_t area() const override;
+  virtual void sample(real_t u, real_t v, vec3_t *position,
+                      vec3_t *normal) const override;
+  virtual void transform(rigid_t const &motion) override;
 
   vec3_t center;
   vec3_t axis[3];
   vec3_t extent;
 };
 
+/// [begin, end) of every primitive type in a GeometrySoA
+struct soa_range_t {
+  int begin[GEOMETRY_TYPES];
+  int end[GEOMETRY_TYPES];
+};
+
+/// geometry compiled into one structure of arrays per primitive type. the
+/// objects of a type are intersected SIMD_WIDTH at a time by a single ray,
+/// without pointer chasing or virtual calls; hits match the Geometry ones.
+class GeometrySoA {
+public:
+  /// compiles the geometries, each type keeps the order of the list
+  void build(std::vector<Geometry const *> const &geometries);
+  /// range covering everything
+  soa_range_t all() const;
+  /// closest hit in range closer than tmax, hit is untouched on a miss
+  bool intersect(soa_range_t const &range, ray_t const &ray, real_t tmax,
+                 hit_t *hit) const;
+  /// whether anything in range is hit in [tmin, tmax]
+  bool occluded(soa_range_t const &range, ray_t const &ray, real_t tmin,
+                real_t tmax) const;
 
+  struct sphere_array_t {
+    std::vector<real_t> cx, cy, cz, radius2;
+    std::vector<int>    id;
+  } spheres;
+  struct plane_array_t {
+    std::vector<real_t> cx, cy, cz, nx, ny, nz;
+    std::vector<real_t> dist;    // dot(normal, center)
+    std::vector<real_t> radius2; // disks only
+    std::vector<int>    id;
+  } planes, disks;
+  struct box_array_t {
+    std::vector<real_t> cx, cy, cz;
+    std::vector<real_t> ax[3], ay[3], az[3]; // components of the three axes
+    std::vector<real_t> ex, ey, ez;
+    std::vector<int>    id;
+  } boxes;
+};
@@ -0,0 +1,200 @@
+#include "grid.h"
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+static const real_t GRID_DENSITY = real_t(4); // cells per primitive
+static const int    GRID_MAX_RESOLUTION = 256;
+
+/// cells [lo, hi] per axis that the box overlaps
+static void cellRange(Grid const &grid, aabb_t const &box, int *lo, int *hi) {
+  for (int a = 0; a < 3; ++a) {
+    real_t const min = axisOf(grid.bounds.min, a);
+    real_t const size = axisOf(grid.cell_size, a);
+    real_t const last = real_t(grid.resolution[a] - 1);
+    lo[a] = int(clamp((axisOf(box.min, a) - min) / size, real_t(0), last));
+    hi[a] = int(clamp((axisOf(box.max, a) - min) / size, real_t(0), last));
+  }
+}
+
+void Grid::build(std::vector<Geometry *> const &geometries) {
+  auto const start = std::chrono::high_resolution_clock::now();
+  bounds = aabb_t();
+  cells.clear();
+  ranges.clear();
+
+  std::vector<Geometry const *> bounded;
+  std::vector<aabb_t>           boxes;
+  for (Geometry const *g : geometries) {
+    aabb_t box;
+    if (g->bounds(&box)) {
+      bounded.push_back(g);
+      boxes.push_back(box);
+      bounds = merge(bounds, box);
+    }
+  }
+  primitives = int(bounded.size());
+  references = 0;
+  if (bounded.empty()) {
+    resolution[0] = resolution[1] = resolution[2] = 0;
+    soa.build(bounded);
+    build_time = 0;
+    return;
+  }
+
+  // a little slack keeps primitives on the bounds inside and flat scenes
+  // from having no volume
+  vec3_t const slack = (bounds.max - bounds.min) * real_t(1e-4) + vec3_t(real_t(1e-4), real_t(1e-4), real_t(1e-4));
+  bounds = aabb_t(bounds.min - slack, bounds.max + slack);
+  vec3_t const extent = bounds.max - bounds.min;
+  real_t const per_length = std::cbrt(GRID_DENSITY * real_t(primitives) / (extent.x * extent.y * extent.z));
+  for (int a = 0; a < 3; ++a) {
+    resolution[a] = std::max(1, std::min(int(axisOf(extent, a) * per_length), GRID_MAX_RESOLUTION));
+  }
+  cell_size = vec3_t(extent.x / real_t(resolution[0]), extent.y / real_t(resolution[1]),
+                     extent.z / real_t(resolution[2]));
+
+  // count the references of every cell, then lay them out cell by cell
+  int const count = resolution[0] * resolution[1] * resolution[2];
+  std::vector<int> first(count + 1, 0);
+  for (aabb_t const &box : boxes) {
+    int lo[3], hi[3];
+    cellRange(*this, box, lo, hi);
+    for (int z = lo[2]; z <= hi[2]; ++z) {
+      for (int y = lo[1]; y <= hi[1]; ++y) {
+        for (int x = lo[0]; x <= hi[0]; ++x) {
+          ++first[(z * resolution[1] + y) * resolution[0] + x + 1];
+        }
+      }
+    }
+  }
+  for (int i = 0; i < count; ++i) {
+    first[i + 1] += first[i];
+  }
+  references = first[count];
+  std::vector<Geometry const *> refs(references);
+  std::vector<int>              fill(first.begin(), first.end() - 1);
+  for (int i = 0; i < primitives; ++i) {
+    int lo[3], hi[3];
+    cellRange(*this, boxes[i], lo, hi);
+    for (int z = lo[2]; z <= hi[2]; ++z) {
+      for (int y = lo[1]; y <= hi[1]; ++y) {
+        for (int x = lo[0]; x <= hi[0]; ++x) {
+          refs[fill[(z * resolution[1] + y) * resolution[0] + x]++] = bounded[i];
+        }
+      }
+    }
+  }
+
+  // the compiled arrays keep the order within each type, so every cell
+  // covers a contiguous range of each
+  soa.build(refs);
+  cells.assign(count, -1);
+  int next[GEOMETRY_TYPES] = {0};
+  for (int c = 0; c < count; ++c) {
+    if (first[c] == first[c + 1]) {
+      continue;
+    }
+    soa_range_t range;
+    for (int t = 0; t < GEOMETRY_TYPES; ++t) {
+      range.begin[t] = next[t];
+    }
+    for (int i = first[c]; i < first[c + 1]; ++i) {
+      ++next[refs[i]->type()];
+    }
+    for (int t = 0; t < GEOMETRY_TYPES; ++t) {
+      range.end[t] = next[t];
+    }
+    cells[c] = int(ranges.size());
+    ranges.push_back(range);
+  }
+
+  auto const duration = std::chrono::high_resolution_clock::now() - start;
+  build_time =
+      std::chrono::duration<double, std::milli>(duration).count();
+}
+
+/// visits the cells the ray passes in [tmin, tmax] front to back with
+/// visit(cell, enter, exit) until it returns false
+template <class Visit>
+static void walk(Grid const &grid, ray_t const &ray, real_t tmin, real_t tmax,
+                 Visit const &visit) {
+  vec3_t const inv_dir(real_t(1) / ray.direction.x,
+                       real_t(1) / ray.direction.y,
+                       real_t(1) / ray.direction.z);
+  if (grid.cells.empty() || !clipToBox(grid.bounds, ray.origin, inv_dir, &tmin, &tmax)) {
+    return;
+  }
+  vec3_t const entry = ray.origin + ray.direction * tmin;
+  int    cell[3], step[3], end[3];
+  real_t next[3], delta[3];
+  for (int a = 0; a < 3; ++a) {
+    real_t const origin = axisOf(ray.origin, a);
+    real_t const dir = axisOf(ray.direction, a);
+    real_t const min = axisOf(grid.bounds.min, a);
+    real_t const size = axisOf(grid.cell_size, a);
+    cell[a] = int(clamp((axisOf(entry, a) - min) / size, real_t(0), real_t(grid.resolution[a] - 1)));
+    if (dir > 0) {
+      step[a] = 1;
+      end[a] = grid.resolution[a];
+      next[a] = (min + real_t(cell[a] + 1) * size - origin) / dir;
+      delta[a] = size / dir;
+    } else if (dir < 0) {
+      step[a] = -1;
+      end[a] = -1;
+      next[a] = (min + real_t(cell[a]) * size - origin) / dir;
+      delta[a] = -size / dir;
+    } else {
+      step[a] = 0;
+      end[a] = -1;
+      next[a] = std::numeric_limits<real_t>::infinity();
+      delta[a] = std::numeric_limits<real_t>::infinity();
+    }
+  }
+  for (;;) {
+    int const a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+                                    : (next[1] < next[2] ? 1 : 2);
+    real_t const exit = std::min(next[a], tmax);
+    if (!visit((cell[2] * grid.resolution[1] + cell[1]) * grid.resolution[0] + cell[0],
+               tmin, exit) ||
+        next[a] >= tmax) {
+      return;
+    }
+    cell[a] += step[a];
+    if (cell[a] == end[a]) {
+      return;
+    }
+    tmin = next[a];
+    next[a] += delta[a];
+  }
+}
+
+bool Grid::intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                     long long *visits) const {
+  bool      found = false;
+  long long visited = 0;
+  walk(*this, ray, real_t(0), tmax, [&](int cell, real_t, real_t exit) {
+    ++visited;
+    int const range = cells[cell];
+    if (range >= 0 && soa.intersect(ranges[range], ray, tmax, hit)) {
+      tmax = hit->t;
+      found = true;
+    }
+    // references of later cells can not be closer than a hit in this one
+    return tmax > exit;
+  });
+  if (visits) {
+    *visits += visited;
+  }
+  return found;
+}
+
+bool Grid::occluded(ray_t const &ray, real_t tmin, real_t tmax) const {
+  bool occluded = false;
+  walk(*this, ray, tmin, tmax, [&](int cell, real_t, real_t) {
+    int const range = cells[cell];
+    occluded = range >= 0 && soa.occluded(ranges[range], ray, tmin, tmax);
+    return !occluded;
+  });
+  return occluded;
+}
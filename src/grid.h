@@ -0,0 +1,28 @@
+#pragma once
+#include "geometry.h"
+#include <vector>
+
+/// uniform grid over bounded geometries, traversed with a 3d dda. every
+/// primitive is referenced by each cell its bounds overlap; the references
+/// are compiled cell by cell, so a cell covers a contiguous range of each type
+/// in the soa arrays, just like a bvh leaf.
+class Grid {
+public:
+  void build(std::vector<Geometry *> const &geometries);
+  /// finds the closest hit closer than tmax, hit is untouched on a miss.
+  /// adds the number of cells visited to visits if given.
+  bool intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                 long long *visits = nullptr) const;
+  /// any hit in [tmin, tmax], stops at the first one found
+  bool occluded(ray_t const &ray, real_t tmin, real_t tmax) const;
+
+  aabb_t                   bounds;
+  int                      resolution[3] = {0, 0, 0};
+  vec3_t                   cell_size;
+  std::vector<int>         cells;  // x fastest, index into ranges, -1 if empty
+  std::vector<soa_range_t> ranges;
+  GeometrySoA              soa;    // references of the non-empty cells
+  int                      primitives = 0;
+  int                      references = 0;
+  double                   build_time = 0; // milliseconds
+};
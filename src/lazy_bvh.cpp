@@ -0,0 +1,202 @@
+#include "lazy_bvh.h"
+#include <chrono>
+#include <algorithm>
+
+static const int LAZY_TOP_LEVELS = 4; // split by build(), the rest on demand
+static const int LAZY_MAX_LEAF_SIZE = 4;
+static const int LAZY_MAX_SAH_DEPTH = 40;
+static const int LAZY_STACK_SIZE = 64;
+
+void LazyBVH::split(int index) const {
+  lazy_node_t &node = nodes[index];
+  if (node.ready.load(std::memory_order_acquire)) {
+    return;
+  }
+  std::call_once(node.split, [this, &node] {
+    auto const start = std::chrono::high_resolution_clock::now();
+    aabb_t cbounds;
+    for (int i = node.begin; i < node.end; ++i) {
+      cbounds = merge(cbounds, refs[i].center);
+    }
+    int const count = node.end - node.begin;
+    int       mid = node.begin;
+    int       axis = 0;
+    real_t    pos = real_t(0);
+    bool      split = count > 1 && node.depth < LAZY_MAX_SAH_DEPTH &&
+                      findSahSplit(refs, node.begin, node.end, node.bounds, cbounds, &axis, &pos);
+    if (split) {
+      mid = int(std::partition(refs.begin() + node.begin, refs.begin() + node.end,
+                               [axis, pos](bvh_ref_t const &r) {
+                                 return axisOf(r.center, axis) < pos;
+                               }) -
+                refs.begin());
+    } else if (count > LAZY_MAX_LEAF_SIZE) {
+      // too many primitives for a leaf, fall back to an object median split
+      vec3_t const d = cbounds.max - cbounds.min;
+      axis = d.x > d.y && d.x > d.z ? 0 : (d.y > d.z ? 1 : 2);
+      mid = node.begin + count / 2;
+      std::nth_element(refs.begin() + node.begin, refs.begin() + mid,
+                       refs.begin() + node.end,
+                       [axis](bvh_ref_t const &a, bvh_ref_t const &b) {
+                         return axisOf(a.center, axis) < axisOf(b.center, axis);
+                       });
+      split = true;
+    }
+
+    if (!split || mid == node.begin || mid == node.end) {
+      node.child = -1;
+    } else {
+      int const child = node_count.fetch_add(2);
+      int const first[2] = {node.begin, mid};
+      int const last[2] = {mid, node.end};
+      for (int c = 0; c < 2; ++c) {
+        lazy_node_t &n = nodes[child + c];
+        n.begin = first[c];
+        n.end = last[c];
+        n.depth = node.depth + 1;
+        n.bounds = aabb_t();
+        for (int i = n.begin; i < n.end; ++i) {
+          n.bounds = merge(n.bounds, refs[i].bounds);
+        }
+      }
+      node.child = child;
+    }
+    node.ready.store(true, std::memory_order_release);
+    auto const duration = std::chrono::high_resolution_clock::now() - start;
+    split_time += std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+  });
+}
+
+void LazyBVH::build(std::vector<Geometry *> const &geometries) {
+  auto const start = std::chrono::high_resolution_clock::now();
+  refs.clear();
+  refs.reserve(geometries.size());
+  for (Geometry const *g : geometries) {
+    bvh_ref_t ref;
+    if (g->bounds(&ref.bounds)) {
+      ref.center = centroid(ref.bounds);
+      ref.geometry = g;
+      refs.push_back(ref);
+    }
+  }
+  primitives = int(refs.size());
+  nodes.reset(refs.empty() ? nullptr : new lazy_node_t[2 * refs.size() - 1]);
+  node_count = refs.empty() ? 0 : 1;
+  if (!refs.empty()) {
+    lazy_node_t &root = nodes[0];
+    root.begin = 0;
+    root.end = primitives;
+    root.depth = 0;
+    root.bounds = aabb_t();
+    for (bvh_ref_t const &ref : refs) {
+      root.bounds = merge(root.bounds, ref.bounds);
+    }
+    // nodes are numbered level by level up to here, so the top levels are
+    // the nodes made before each pass
+    for (int level = 0, first = 0; level < LAZY_TOP_LEVELS; ++level) {
+      int const last = node_count;
+      for (int i = first; i < last; ++i) {
+        split(i);
+      }
+      first = last;
+    }
+  }
+  split_time = 0;
+
+  auto const duration = std::chrono::high_resolution_clock::now() - start;
+  build_time =
+      std::chrono::duration<double, std::milli>(duration).count();
+}
+
+bool LazyBVH::intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                        long long *visits) const {
+  if (!nodes) {
+    return false;
+  }
+  vec3_t const inv_dir(real_t(1) / ray.direction.x,
+                       real_t(1) / ray.direction.y,
+                       real_t(1) / ray.direction.z);
+  bool found = false;
+
+  struct entry_t {
+    int    node;
+    real_t tnear;
+  } stack[LAZY_STACK_SIZE];
+  int       top = 0;
+  long long visited = 1;
+  if (intersectBox(nodes[0].bounds, ray.origin, inv_dir, tmax, &stack[0].tnear)) {
+    stack[top++].node = 0;
+  }
+  while (top > 0) {
+    entry_t const entry = stack[--top];
+    if (entry.tnear >= tmax) {
+      continue;
+    }
+    split(entry.node);
+    lazy_node_t const &node = nodes[entry.node];
+    if (node.child < 0) {
+      for (int i = node.begin; i < node.end; ++i) {
+        real_t t;
+        if (refs[i].geometry->intersect(ray, tmax, &t)) {
+          tmax = t;
+          hit->t = t;
+          hit->id = refs[i].geometry->id;
+          found = true;
+        }
+      }
+    } else {
+      // push the farther child first so the nearer one is visited next
+      entry_t closer = {node.child, real_t(0)};
+      entry_t farther = {node.child + 1, real_t(0)};
+      bool closer_hit = intersectBox(nodes[closer.node].bounds, ray.origin, inv_dir, tmax, &closer.tnear);
+      bool farther_hit = intersectBox(nodes[farther.node].bounds, ray.origin, inv_dir, tmax, &farther.tnear);
+      visited += 2;
+      if (farther_hit && (!closer_hit || farther.tnear < closer.tnear)) {
+        std::swap(closer, farther);
+        std::swap(closer_hit, farther_hit);
+      }
+      if (farther_hit) {
+        stack[top++] = farther;
+      }
+      if (closer_hit) {
+        stack[top++] = closer;
+      }
+    }
+  }
+  if (visits) {
+    *visits += visited;
+  }
+  return found;
+}
+
+bool LazyBVH::occluded(ray_t const &ray, real_t tmin, real_t tmax) const {
+  if (!nodes) {
+    return false;
+  }
+  vec3_t const inv_dir(real_t(1) / ray.direction.x,
+                       real_t(1) / ray.direction.y,
+                       real_t(1) / ray.direction.z);
+  int    stack[LAZY_STACK_SIZE];
+  int    top = 0;
+  real_t tnear;
+  stack[top++] = 0;
+  while (top > 0) {
+    int const index = stack[--top];
+    if (!intersectBox(nodes[index].bounds, ray.origin, inv_dir, tmax, &tnear)) {
+      continue;
+    }
+    split(index);
+    lazy_node_t const &node = nodes[index];
+    if (node.child < 0) {
+      for (int i = node.begin; i < node.end; ++i) {
+        if (refs[i].geometry->occluded(ray, tmin, tmax)) {
+          return true;
+        }
+      }
+    } else {
+      stack[top++] = node.child + 1;
+      stack[top++] = node.child;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "bvh.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// node of a LazyBVH, split into its children the first time a ray enters it
+struct lazy_node_t {
+  aabb_t            bounds;
+  int               begin, end;    // references of the subtree
+  int               child;         // first of the two adjacent children, -1 for leaves
+  int               depth;
+  std::once_flag    split;         // makes the children or the leaf
+  std::atomic<bool> ready{false};  // set by the split, a cheaper check than call_once()
+};
+
+/// binned SAH bvh built on demand, for quick previews of large scenes. only
+/// the top levels are built up front, every other node is split the first
+/// time a ray enters it, so subtrees no ray reaches are never built. threads
+/// entering a node that another one is splitting wait for that split rather
+/// than repeating it, after that a node costs an atomic load more than in a BVH.
+class LazyBVH {
+public:
+  void build(std::vector<Geometry *> const &geometries);
+  /// finds the closest hit closer than tmax, hit is untouched on a miss.
+  /// adds the number of node boxes tested to visits if given.
+  bool intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                 long long *visits = nullptr) const;
+  /// any hit in [tmin, tmax], stops at the first one found
+  bool occluded(ray_t const &ray, real_t tmin, real_t tmax) const;
+
+  // the const traversal splits nodes, which moves references around
+  // within the ranges of those nodes only
+  mutable std::vector<bvh_ref_t>         refs;
+  mutable std::unique_ptr<lazy_node_t[]> nodes;      // room for a full tree
+  mutable std::atomic<int>               node_count{0};
+  mutable std::atomic<long long>         split_time{0}; // nanoseconds on all threads, top levels excluded
+  int                                    primitives = 0;
+  double                                 build_time = 0; // milliseconds, of the top levels
+
+private:
+  /// makes the children or the leaf of node index, once
+  void split(int index) const;
+};
@@ -1,5 +1,6 @@
 #include "scene.h"
 #include "render.h"
+#include "progressive.h"
 #include "../3rdparty/docopt/docopt.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,7 +12,7 @@ simple path tracer.
 Usage:
   simple-pt (-? | --help)
   simple-pt --version
-  simple-pt <scene> [--width=<w>] [--height=<h>] [--depth=<d>] [--samples=<n>] [--algo=fast|--algo=trace] [--output=<fn>]
+  simple-pt <scene> [--width=<w>] [--height=<h>] [--depth=<d>] [--rr-depth=<r>] [--samples=<n>] [--subpixels=<n>] [--filter=<f>] [--algo=fast|--algo=trace|--algo=progressive] [--pass=<n>] [--max-samples=<n>] [--time-limit=<s>] [--noise=<e>] [--adaptive] [--snapshot=<s>] [--heatmap=<fn>] [--packet=<n>] [--threads=<n>] [--tile=<n>] [--accel=<a>] [--bvh-build=<b>] [--wavefront] [--reorder] [--sampler=<s>] [--seed=<n>] [--frames=<n>] [--output=<fn>] [--reference=<fn>]
 
 Options:
   -?, --help           show this help
@@ -19,11 +20,44 @@ Options:
   -w X, --width=X      image width  [default: 320]
   -h Y, --height=Y     image height [default: 200]
   -d depth, --depth=d  tracing depth (bounce times) [default: 6]
-  -s n, --samples=n    number of samples per pixel [default: 512]
-  -a f, --algo=f       rendering function, fast or trace [default: trace]
-  -o f, --output=f     output file name [default: output.ppm]
+  --rr-depth=r         bounces before russian roulette may end a path [default: 3]
+  -s n, --samples=n    number of samples per sub pixel [default: 512]
+  --subpixels=n        sub pixel strata per axis, 1 to 16 [default: 2]
+  --filter=f           box, tent, gaussian or blackman-harris [default: box]
+  -a f, --algo=f       rendering function, fast, trace or progressive [default: trace]
+  --pass=n             progressive: samples per pixel added by a pass [default: 4]
+  --max-samples=n      progressive: stop at n samples per pixel, 0 for no limit [default: 0]
+  --time-limit=s       progressive: stop before s seconds are over, 0 for no limit [default: 0]
+  --noise=e            progressive: stop once the estimated rmse in ppm units is below e, 0 for no limit [default: 0]
+  --adaptive           progressive: apply --noise to every pixel, retiring those below it
+  --snapshot=s         progressive: write the output every s seconds, 0 for never [default: 0]
+  --heatmap=f          progressive: write the samples per pixel to f
+  -p n, --packet=n     rays traced together, 1, 4, 8 or 16 [default: 16]
+  -t n, --threads=n    render threads, 0 for all hardware threads [default: 0]
+  --tile=n             edge length of the tiles handed to threads [default: 32]
+  --accel=a            bvh, bvh4, bvh8, bvh4q, bvh8q (quantized), lazy (split as rays arrive), grid or none, what finds the bounded geometry [default: bvh]
+  --bvh-build=b        sah, lbvh to build quickly in parallel at some cost in tracing, or sbvh to split large overlapping primitives [default: sah]
+  --wavefront          trace all paths of a tile a bounce at a time, in packets
+  --reorder            wavefront: sort rays by direction octant and morton code of the origin
+  --sampler=s          random, halton, sobol or owen (scrambled sobol) [default: owen]
+  --seed=n             seed of the sample sequences [default: 0]
+  --frames=n           animate n frames, the bounded geometry swirling about the up axis [default: 1]
+  -o f, --output=f     output file name, numbered when animating [default: output.ppm]
+  -r f, --reference=f  ppm to compare the output with, e.g. from the double build
 )";
 
+/// size and build time of any of the bvhs, nodes and leaves count as memory.
+/// references exceed primitives where spatial splits repeated them.
+template <class Tree>
+static void printBvh(char const *name, char const *build, int primitives, int references,
+                     Tree const &tree) {
+  size_t const bytes = tree.nodes.size() * sizeof(tree.nodes[0]) +
+                       tree.leaves.size() * sizeof(tree.leaves[0]);
+  fprintf(stdout, "%s: %d primitives, %d references, %d nodes, %.1f bytes per primitive, %s built in %.2fms\n",
+          name, primitives, references, int(tree.nodes.size()),
+          double(bytes) / double(std::max(primitives, 1)), build, tree.build_time);
+}
+
 int main(int argc, char** argv)
 {
   Scene scene;
@@ -34,25 +68,201 @@ int main(int argc, char** argv)
     fprintf(stderr, "error: %s\n", e.what());
     return -1;
   }
-  if (!scene.read(args["<scene>"].asString())) {
+  accel_type_t accel;
+  if (!parseAccelType(args["--accel"].asString().c_str(), &accel)) {
+    fprintf(stderr, "error: unknown acceleration structure %s\n", args["--accel"].asString().c_str());
+    return -1;
+  }
+  bvh_build_t quality;
+  if (!parseBvhBuild(args["--bvh-build"].asString().c_str(), &quality)) {
+    fprintf(stderr, "error: unknown bvh build %s\n", args["--bvh-build"].asString().c_str());
+    return -1;
+  }
+  if (!scene.read(args["<scene>"].asString(), accel, quality, int(args["--threads"].asLong()))) {
     fprintf(stderr, "failed to read scene %s\n", argv[1]);
     return 2;
   }
+  if (accel == ACCEL_GRID) {
+    fprintf(stdout, "grid: %d primitives, %dx%dx%d cells, %d references, built in %.2fms\n",
+            scene.grid.primitives, scene.grid.resolution[0], scene.grid.resolution[1],
+            scene.grid.resolution[2], scene.grid.references, scene.grid.build_time);
+  } else if (accel == ACCEL_LAZY) {
+    fprintf(stdout, "lazy: %d primitives, %d nodes, top levels built in %.2fms\n",
+            scene.lazy.primitives, int(scene.lazy.node_count), scene.lazy.build_time);
+  } else if (accel != ACCEL_NONE) {
+    char const *name = args["--accel"].asString().c_str();
+    char const *build = args["--bvh-build"].asString().c_str();
+    int const   primitives = int(scene.bounded_list.size());
+    switch (accel) {
+    case ACCEL_BVH4:
+      printBvh(name, build, primitives, scene.bvh4.primitives, scene.bvh4);
+      break;
+    case ACCEL_BVH8:
+      printBvh(name, build, primitives, scene.bvh8.primitives, scene.bvh8);
+      break;
+    case ACCEL_BVH4Q:
+      printBvh(name, build, primitives, scene.bvh4q.primitives, scene.bvh4q);
+      break;
+    case ACCEL_BVH8Q:
+      printBvh(name, build, primitives, scene.bvh8q.primitives, scene.bvh8q);
+      break;
+    default:
+      printBvh(name, build, primitives, int(scene.bvh.primitives.size()), scene.bvh);
+      break;
+    }
+  }
   bitmap_t bm = createRenderTarget(args["--width"].asLong(), args["--height"].asLong());
   option_t opt = {
-    args["--depth"].asLong(),
-    args["--samples"].asLong()
+    int(args["--depth"].asLong()),
+    int(args["--rr-depth"].asLong()),
+    int(args["--samples"].asLong()),
+    int(args["--subpixels"].asLong()),
+    int(args["--packet"].asLong()),
+    int(args["--threads"].asLong()),
+    int(args["--tile"].asLong()),
+    args["--wavefront"].asBool(),
+    args["--reorder"].asBool(),
+    SAMPLER_OWEN,
+    FILTER_BOX,
+    uint32_t(args["--seed"].asLong())
   };
-  if (args["--algo"].asString() == "fast") {
-    renderLowQuality(&bm, scene, opt);
-  } else {
-    auto start = std::chrono::high_resolution_clock::now();
-    render(&bm, scene, opt);
-    auto duration = std::chrono::high_resolution_clock::now() - start;
-    fprintf(stdout, "rendering takes %llds\n", int64_t(std::chrono::duration_cast<std::chrono::seconds>(duration).count()));
+  if (opt.packet != 1 && opt.packet != 4 && opt.packet != 8 && opt.packet != 16) {
+    fprintf(stderr, "error: packet size must be 1, 4, 8 or 16\n");
+    return -1;
+  }
+  if (opt.threads < 0 || opt.tile < 1) {
+    fprintf(stderr, "error: threads must not be negative and tiles not empty\n");
+    return -1;
+  }
+  if (opt.reorder && !opt.wavefront) {
+    fprintf(stderr, "error: reordering needs --wavefront\n");
+    return -1;
+  }
+  if (opt.subpixels < 1 || opt.subpixels > 16) {
+    fprintf(stderr, "error: sub pixels must be 1 to 16 per axis\n");
+    return -1;
+  }
+  if (!parseFilterType(args["--filter"].asString().c_str(), &opt.filter)) {
+    fprintf(stderr, "error: unknown filter %s\n", args["--filter"].asString().c_str());
+    return -1;
+  }
+  if (!parseSamplerType(args["--sampler"].asString().c_str(), &opt.sampler)) {
+    fprintf(stderr, "error: unknown sampler %s\n", args["--sampler"].asString().c_str());
+    return -1;
   }
   std::string ofn = args["--output"].asString();
-  saveRenderTarget(ofn.c_str(), bm);
+  progressive_t progressive = {
+    int(args["--pass"].asLong()),
+    int(args["--max-samples"].asLong()),
+    std::atof(args["--time-limit"].asString().c_str()),
+    std::atof(args["--noise"].asString().c_str()),
+    std::atof(args["--snapshot"].asString().c_str()),
+    args["--adaptive"].asBool(),
+    ofn.c_str(),
+    nullptr
+  };
+  std::string hfn;
+  if (args["--heatmap"]) {
+    hfn = args["--heatmap"].asString();
+    progressive.heatmap = hfn.c_str();
+  }
+  if (progressive.pass < 1 || progressive.max_samples < 0 || progressive.time_limit < 0.0 ||
+      progressive.noise < 0.0 || progressive.snapshot < 0.0) {
+    fprintf(stderr, "error: passes must not be empty and limits not negative\n");
+    return -1;
+  }
+  if (args["--algo"].asString() == "progressive" && progressive.max_samples == 0 &&
+      progressive.time_limit == 0.0 && progressive.noise == 0.0) {
+    fprintf(stderr, "error: progressive rendering needs --max-samples, --time-limit or --noise\n");
+    return -1;
+  }
+  if (progressive.adaptive && progressive.noise == 0.0) {
+    fprintf(stderr, "error: adaptive rendering needs --noise\n");
+    return -1;
+  }
+  int const frames = int(args["--frames"].asLong());
+  if (frames < 1) {
+    fprintf(stderr, "error: frames must be at least 1\n");
+    return -1;
+  }
+  // every frame turns each bounded geometry about the camera's up axis through
+  // the center of the bounds, those near the axis faster, so the hierarchy
+  // over them degrades as the animation goes on
+  std::vector<rigid_t> motions;
+  if (frames > 1) {
+    aabb_t bounds;
+    for (Geometry const *g : scene.bounded_list) {
+      aabb_t box;
+      g->bounds(&box);
+      bounds = merge(bounds, box);
+    }
+    vec3_t const pivot = centroid(bounds);
+    vec3_t const axis = normalize(scene.camera.up);
+    real_t const radius = length(bounds.max - bounds.min) * real_t(0.5);
+    motions.reserve(scene.bounded_list.size());
+    for (Geometry const *g : scene.bounded_list) {
+      aabb_t box;
+      g->bounds(&box);
+      vec3_t const offset = centroid(box) - pivot;
+      real_t const distance = length(offset - axis * dot(axis, offset));
+      motions.push_back(turn(pivot, axis, real_t(2) * PI / real_t(frames) * radius / (radius + distance)));
+    }
+  }
+  for (int frame = 0; frame < frames; ++frame) {
+    if (frame > 0) {
+      for (size_t i = 0; i < motions.size(); ++i) {
+        scene.transform(scene.bounded_list[i]->id, motions[i]);
+      }
+      auto const start = std::chrono::high_resolution_clock::now();
+      bool const refit = scene.update();
+      auto const duration = std::chrono::high_resolution_clock::now() - start;
+      double const ms = std::chrono::duration<double, std::milli>(duration).count();
+      if (refit) {
+        fprintf(stdout, "frame %d: bvh refit in %.2fms, %.2f times the sah cost of a build\n",
+                frame, ms, double(scene.bvh.refit_cost));
+      } else {
+        fprintf(stdout, "frame %d: built again in %.2fms\n", frame, ms);
+      }
+    }
+    std::string fn = ofn;
+    if (frames > 1) {
+      char number[16];
+      snprintf(number, sizeof(number), "-%04d", frame);
+      size_t const dot = fn.find_last_of('.');
+      size_t const slash = fn.find_last_of("/\\");
+      bool const extension = dot != std::string::npos && (slash == std::string::npos || slash < dot);
+      fn.insert(extension ? dot : fn.size(), number);
+    }
+    progressive.output = fn.c_str();
+    if (args["--algo"].asString() == "fast") {
+      renderLowQuality(&bm, scene, opt);
+    } else {
+      auto start = std::chrono::high_resolution_clock::now();
+      if (args["--algo"].asString() == "progressive") {
+        renderProgressive(&bm, scene, opt, progressive);
+      } else {
+        render(&bm, scene, opt);
+      }
+      auto duration = std::chrono::high_resolution_clock::now() - start;
+      fprintf(stdout, "rendering takes %llds\n", int64_t(std::chrono::duration_cast<std::chrono::seconds>(duration).count()));
+    }
+    if (accel == ACCEL_LAZY) {
+      fprintf(stdout, "lazy: %d of at most %d nodes, split on demand in %.2fms thread time\n",
+              int(scene.lazy.node_count), std::max(2 * scene.lazy.primitives - 1, 0),
+              double(scene.lazy.split_time) * 1e-6);
+    }
+    saveRenderTarget(fn.c_str(), bm);
+    if (args["--reference"]) {
+      std::string const rfn = args["--reference"].asString();
+      image_diff_t diff;
+      if (!compareRenderTarget(rfn.c_str(), bm, &diff)) {
+        fprintf(stderr, "error: can not compare with %s\n", rfn.c_str());
+      } else {
+        fprintf(stdout, "difference to %s: rmse %.3f, psnr %.2fdb, max %d, %d of %d pixels differ\n",
+                rfn.c_str(), diff.rmse, diff.psnr, diff.max_error, diff.pixels, bm.width*bm.height);
+      }
+    }
+  }
   deleteRenderTarget(&bm);
   system(ofn.c_str());
   return 0;
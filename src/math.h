@@ -1,90 +1,258 @@
 #pragma once
 #include <cmath>
+#include <stdint.h>
 #include <algorithm>
+#include <limits>
 
+// precision of traversal, intersection and shading. define SIMPLE_PT_FLOAT
+// to run everything in float, or SIMPLE_PT_MIXED to trace in float and place
+// the winning hit in double (see Geometry::surface()).
+#if defined(SIMPLE_PT_FLOAT) || defined(SIMPLE_PT_MIXED)
+#define SIMPLE_PT_REAL_FLOAT
+typedef float real_t;
+#else
 typedef double real_t;
+#endif
 static const real_t PI = real_t(3.1415926535897932384626);
 
-struct vec3_t {
-  vec3_t(real_t x = 0.0f, real_t y = 0.0f, real_t z = 0.0f)
+/// keeps scalar arguments out of template argument deduction, so vec3<float>
+/// can be scaled by a double literal and the other way round
+template <class T> struct scalar_arg { typedef T type; };
+
+template <class T>
+struct vec3 {
+  vec3(T x = T(0), T y = T(0), T z = T(0))
       : x(x), y(y), z(z) {}
-  vec3_t& operator=(vec3_t const& v) {
-    x = v.x;
-    y = v.y;
-    z = v.z;
-    return *this;
-  }
-  vec3_t operator-() const { return vec3_t(-x, -y, -z); }
+  template <class U>
+  explicit vec3(vec3<U> const &v) : x(T(v.x)), y(T(v.y)), z(T(v.z)) {}
+  vec3 operator-() const { return vec3(-x, -y, -z); }
 
-  real_t x, y, z;
+  T x, y, z;
 };
 
-inline vec3_t operator+(vec3_t const &a, vec3_t const &b) {
-  return vec3_t(a.x + b.x, a.y + b.y, a.z + b.z);
+typedef vec3<real_t> vec3_t;
+typedef vec3<double> vec3d_t;
+
+template <class T>
+inline vec3<T> operator+(vec3<T> const &a, vec3<T> const &b) {
+  return vec3<T>(a.x + b.x, a.y + b.y, a.z + b.z);
 }
 
-inline vec3_t operator-(vec3_t const &a, vec3_t const &b) {
-  return vec3_t(a.x - b.x, a.y - b.y, a.z - b.z);
+template <class T>
+inline vec3<T> operator-(vec3<T> const &a, vec3<T> const &b) {
+  return vec3<T>(a.x - b.x, a.y - b.y, a.z - b.z);
 }
 
-inline vec3_t operator*(vec3_t const &a, vec3_t const &b) {
-  return vec3_t(a.x * b.x, a.y * b.y, a.z * b.z);
+template <class T>
+inline vec3<T> operator*(vec3<T> const &a, vec3<T> const &b) {
+  return vec3<T>(a.x * b.x, a.y * b.y, a.z * b.z);
 }
 
-inline vec3_t operator*(vec3_t const &a, real_t r) {
-  return vec3_t(a.x * r, a.y * r, a.z * r);
+template <class T>
+inline vec3<T> operator*(vec3<T> const &a, typename scalar_arg<T>::type r) {
+  return vec3<T>(a.x * r, a.y * r, a.z * r);
 }
 
-inline vec3_t operator*(real_t r, vec3_t const &a) {
-  return vec3_t(a.x * r, a.y * r, a.z * r);
+template <class T>
+inline vec3<T> operator*(typename scalar_arg<T>::type r, vec3<T> const &a) {
+  return vec3<T>(a.x * r, a.y * r, a.z * r);
 }
 
-inline vec3_t &operator*=(vec3_t &v, float f) {
+template <class T>
+inline vec3<T> &operator*=(vec3<T> &v, typename scalar_arg<T>::type f) {
   v.x *= f;
   v.y *= f;
   v.z *= f;
   return v;
 }
 
-inline vec3_t &operator+=(vec3_t &a, vec3_t const &b) {
+template <class T>
+inline vec3<T> &operator+=(vec3<T> &a, vec3<T> const &b) {
   a.x += b.x;
   a.y += b.y;
   a.z += b.z;
   return a;
 }
 
-inline real_t dot(vec3_t const &a, vec3_t const &b) {
+template <class T>
+inline T dot(vec3<T> const &a, vec3<T> const &b) {
   return a.x * b.x + a.y * b.y + a.z * b.z;
 }
 
-inline vec3_t cross(vec3_t const &a, vec3_t const &b) {
-  return vec3_t(a.y * b.z - b.y * a.z,
-                a.z * b.x - b.z * a.x,
-                a.x * b.y - a.y * b.x);
+template <class T>
+inline vec3<T> cross(vec3<T> const &a, vec3<T> const &b) {
+  return vec3<T>(a.y * b.z - b.y * a.z,
+                 a.z * b.x - b.z * a.x,
+                 a.x * b.y - a.y * b.x);
 }
 
-inline real_t clamp(real_t const& v, real_t min, real_t max) {
+template <class T>
+inline T clamp(T const& v, typename scalar_arg<T>::type min,
+               typename scalar_arg<T>::type max) {
   return std::max(std::min(max, v), min);
 }
 
-inline vec3_t clamp(vec3_t const& v, real_t min, real_t max) {
-  return vec3_t(
+template <class T>
+inline vec3<T> clamp(vec3<T> const& v, typename scalar_arg<T>::type min,
+                     typename scalar_arg<T>::type max) {
+  return vec3<T>(
     clamp(v.x, min, max),
     clamp(v.y, min, max),
     clamp(v.z, min, max)
   );
 }
 
-inline vec3_t clamp(vec3_t const& v, vec3_t const& min, vec3_t const& max) {
-  return vec3_t(
+template <class T>
+inline vec3<T> clamp(vec3<T> const& v, vec3<T> const& min, vec3<T> const& max) {
+  return vec3<T>(
     clamp(v.x, min.x, max.x),
     clamp(v.y, min.y, max.y),
     clamp(v.z, min.z, max.z)
   );
 }
 
-inline real_t lengthSquare(vec3_t const &a) { return dot(a, a); }
+template <class T>
+inline T lengthSquare(vec3<T> const &a) { return dot(a, a); }
+
+template <class T>
+inline T length(vec3<T> const &a) { return std::sqrt(lengthSquare(a)); }
+
+template <class T>
+inline vec3<T> normalize(vec3<T> const &a) { return T(1.0) / length(a) * a; }
+
+template <class T>
+inline vec3<T> abs(vec3<T> const &a) {
+  return vec3<T>(std::abs(a.x), std::abs(a.y), std::abs(a.z));
+}
+
+template <class T>
+inline vec3<T> min(vec3<T> const &a, vec3<T> const &b) {
+  return vec3<T>(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+template <class T>
+inline vec3<T> max(vec3<T> const &a, vec3<T> const &b) {
+  return vec3<T>(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
+/// rigid motion, a rotation taking the coordinate axes to x, y and z
+/// followed by a translation
+struct rigid_t {
+  vec3_t x, y, z;
+  vec3_t offset;
+};
+
+inline vec3_t rotate(rigid_t const &m, vec3_t const &v) {
+  return m.x * v.x + m.y * v.y + m.z * v.z;
+}
+
+inline vec3_t apply(rigid_t const &m, vec3_t const &p) {
+  return rotate(m, p) + m.offset;
+}
+
+/// turn by angle radians about the unit axis through pivot
+inline rigid_t turn(vec3_t const &pivot, vec3_t const &axis, real_t angle) {
+  real_t const c = std::cos(angle), s = std::sin(angle);
+  // rodrigues' rotation formula applied to each coordinate axis
+  auto const r = [&](vec3_t const &v) {
+    return v * c + cross(axis, v) * s + axis * (dot(axis, v) * (real_t(1) - c));
+  };
+  rigid_t m = {r(vec3_t(1, 0, 0)), r(vec3_t(0, 1, 0)), r(vec3_t(0, 0, 1)), vec3_t()};
+  m.offset = pivot - rotate(m, pivot);
+  return m;
+}
+
+/// axis aligned bounding box, empty when default constructed
+struct aabb_t {
+  aabb_t()
+      : min(std::numeric_limits<real_t>::max(), std::numeric_limits<real_t>::max(),
+            std::numeric_limits<real_t>::max()),
+        max(-std::numeric_limits<real_t>::max(), -std::numeric_limits<real_t>::max(),
+            -std::numeric_limits<real_t>::max()) {}
+  aabb_t(vec3_t const &min, vec3_t const &max) : min(min), max(max) {}
+
+  vec3_t min, max;
+};
+
+inline aabb_t merge(aabb_t const &a, aabb_t const &b) {
+  return aabb_t(min(a.min, b.min), max(a.max, b.max));
+}
+
+inline aabb_t merge(aabb_t const &a, vec3_t const &p) {
+  return aabb_t(min(a.min, p), max(a.max, p));
+}
+
+/// common part of a and b, min exceeds max somewhere if there is none
+inline aabb_t overlap(aabb_t const &a, aabb_t const &b) {
+  return aabb_t(max(a.min, b.min), min(a.max, b.max));
+}
+
+inline bool empty(aabb_t const &a) {
+  return a.min.x > a.max.x || a.min.y > a.max.y || a.min.z > a.max.z;
+}
+
+inline bool contains(aabb_t const &outer, aabb_t const &inner) {
+  return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z &&
+         outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+}
 
-inline real_t length(vec3_t const &a) { return std::sqrt(lengthSquare(a)); }
+inline vec3_t centroid(aabb_t const &a) { return (a.min + a.max) * real_t(0.5); }
 
-inline vec3_t normalize(vec3_t const &a) { return real_t(1.0) / length(a) * a; }
+/// surface area, zero for empty boxes
+inline real_t area(aabb_t const &a) {
+  vec3_t const d = a.max - a.min;
+  if (d.x < 0 || d.y < 0 || d.z < 0) {
+    return real_t(0);
+  }
+  return real_t(2) * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+/// coordinate axis of v, 0 for x, 1 for y and 2 for z
+inline real_t axisOf(vec3_t const &v, int axis) {
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+/// slab test, clips [tmin, tmax] to the part of the ray from origin with
+/// reciprocal direction inv_dir inside the box. false if nothing is left.
+inline bool clipToBox(aabb_t const &box, vec3_t const &origin, vec3_t const &inv_dir,
+                      real_t *tmin, real_t *tmax) {
+  real_t const tx0 = (box.min.x - origin.x) * inv_dir.x;
+  real_t const tx1 = (box.max.x - origin.x) * inv_dir.x;
+  real_t const ty0 = (box.min.y - origin.y) * inv_dir.y;
+  real_t const ty1 = (box.max.y - origin.y) * inv_dir.y;
+  real_t const tz0 = (box.min.z - origin.z) * inv_dir.z;
+  real_t const tz1 = (box.max.z - origin.z) * inv_dir.z;
+  // NaN from 0*inf must not cull the box, keep the accumulated value first
+  real_t t0 = *tmin;
+  real_t t1 = *tmax;
+  t0 = std::max(t0, std::min(tx0, tx1));
+  t1 = std::min(t1, std::max(tx0, tx1));
+  t0 = std::max(t0, std::min(ty0, ty1));
+  t1 = std::min(t1, std::max(ty0, ty1));
+  t0 = std::max(t0, std::min(tz0, tz1));
+  t1 = std::min(t1, std::max(tz0, tz1));
+  *tmin = t0;
+  *tmax = t1;
+  return t0 <= t1;
+}
+
+/// spreads the low 10 bits of x apart, two zero bits after each
+inline uint32_t spreadBits(uint32_t x) {
+  x &= 0x3ffu;
+  x = (x | (x << 16)) & 0x030000ffu;
+  x = (x | (x << 8)) & 0x0300f00fu;
+  x = (x | (x << 4)) & 0x030c30c3u;
+  x = (x | (x << 2)) & 0x09249249u;
+  return x;
+}
+
+/// 30 bit morton code of p on a 1024^3 grid over bounds, points outside are
+/// clamped onto it
+inline uint32_t mortonCode(vec3_t const &p, aabb_t const &bounds) {
+  vec3_t const extent = max(bounds.max - bounds.min, vec3_t(real_t(1e-12), real_t(1e-12), real_t(1e-12)));
+  vec3_t const d = p - bounds.min;
+  uint32_t const x = uint32_t(clamp(d.x / extent.x * real_t(1024), real_t(0), real_t(1023)));
+  uint32_t const y = uint32_t(clamp(d.y / extent.y * real_t(1024), real_t(0), real_t(1023)));
+  uint32_t const z = uint32_t(clamp(d.z / extent.z * real_t(1024), real_t(0), real_t(1023)));
+  return (spreadBits(x) << 2) | (spreadBits(y) << 1) | spreadBits(z);
+}
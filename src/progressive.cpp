@@ -0,0 +1,242 @@
+#include "progressive.h"
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// latest image of the render, saved every period seconds on its own thread
+class SnapshotWriter {
+public:
+  SnapshotWriter(char const *filename, int width, int height, double period)
+    : filename(filename), period(period), image(createRenderTarget(width, height)),
+      copy(createRenderTarget(width, height)) {
+    if (period > 0.0) {
+      thread = std::thread([this] { run(); });
+    }
+  }
+
+  ~SnapshotWriter() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopped = true;
+    }
+    wake.notify_one();
+    if (thread.joinable()) {
+      thread.join();
+    }
+    deleteRenderTarget(&image);
+    deleteRenderTarget(&copy);
+  }
+
+  /// hands over a new image, costs a copy
+  void publish(bitmap_t const& bm) {
+    if (!thread.joinable()) {
+      return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    std::copy(bm.pixels, bm.pixels + bm.width*bm.height, image.pixels);
+    fresh = true;
+  }
+
+private:
+  void run() {
+    auto next = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stopped) {
+      next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(period));
+      wake.wait_until(guard, next, [this] { return stopped; });
+      if (stopped || !fresh) {
+        continue;
+      }
+      std::copy(image.pixels, image.pixels + image.width*image.height, copy.pixels);
+      fresh = false;
+      guard.unlock();
+      if (!saveRenderTarget(filename, copy)) {
+        fprintf(stderr, "error: can not write snapshot %s\n", filename);
+      }
+      guard.lock();
+    }
+  }
+
+  char const             *filename;
+  double                  period;
+  bitmap_t                image; // latest published, guarded by lock
+  bitmap_t                copy;  // being written, owned by thread
+  bool                    fresh = false;
+  bool                    stopped = false;
+  std::mutex              lock;
+  std::condition_variable wake;
+  std::thread             thread;
+};
+
+/// accumulated passes. per pixel the sum of the colors, and running mean and
+/// sum of squared deviations (welford) of the clamped 8 bit values of its
+/// pass means. retired pixels are no longer rendered.
+struct accumulation_t {
+  std::vector<vec3_t>  sum;
+  std::vector<vec3_t>  mean;
+  std::vector<vec3_t>  m2;
+  std::vector<int>     samples;
+  std::vector<int>     passes;
+  std::vector<uint8_t> active;
+  int                  total = 0; // samples of the active pixels
+  int                  pass_count = 0;
+};
+
+static void accumulate(bitmap_t const& pass, int samples, accumulation_t *acc) {
+  for (size_t i = 0; i < acc->sum.size(); ++i) {
+    if (!acc->active[i]) {
+      continue;
+    }
+    vec3_t const& c = pass.pixels[i];
+    vec3_t const d = clamp(c, 0, 1) * real_t(255);
+    acc->sum[i] += c * real_t(samples);
+    acc->samples[i] += samples;
+    acc->passes[i] += 1;
+    vec3_t const delta = d - acc->mean[i];
+    acc->mean[i] += delta * (real_t(1) / real_t(acc->passes[i]));
+    acc->m2[i] += delta * (d - acc->mean[i]);
+  }
+  acc->total += samples;
+  acc->pass_count += 1;
+}
+
+/// squared standard error of the mean of pixel i, largest channel if max is
+/// set, else the sum of the channels. infinite before its second pass.
+static double squaredError(accumulation_t const& acc, size_t i, bool max) {
+  int const n = acc.passes[i];
+  if (n < 2) {
+    return std::numeric_limits<double>::infinity();
+  }
+  vec3_t const& m2 = acc.m2[i];
+  double const scale = 1.0 / (double(n) * double(n - 1));
+  return max ? double(std::max(m2.x, std::max(m2.y, m2.z))) * scale
+             : double(m2.x + m2.y + m2.z) * scale;
+}
+
+/// root mean square over all channels of the standard error of the pixel
+/// means, from the spread of their pass means
+static double noiseEstimate(accumulation_t const& acc) {
+  double sum = 0.0;
+  for (size_t i = 0; i < acc.sum.size(); ++i) {
+    sum += squaredError(acc, i, false);
+  }
+  return std::sqrt(sum / (3.0 * double(acc.sum.size())));
+}
+
+/// passes a pixel gets before it may retire; fewer give variance estimates
+/// that miss rare paths such as caustics
+static const int ADAPTIVE_MIN_PASSES = 4;
+
+/// retires pixels whose standard error, and that of their 8 neighbours, is
+/// below noise. the neighbours guard against pixels that happened to miss a
+/// rare path so far. returns the number of pixels still active.
+static int retirePixels(int width, int height, double noise, accumulation_t *acc) {
+  std::vector<double> error(acc->sum.size());
+  for (size_t i = 0; i < error.size(); ++i) {
+    error[i] = squaredError(*acc, i, true);
+  }
+  double const limit = noise * noise;
+  int remaining = 0;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      uint8_t &active = acc->active[y*width + x];
+      if (!active) {
+        continue;
+      }
+      bool converged = acc->passes[y*width + x] >= ADAPTIVE_MIN_PASSES;
+      for (int ny = std::max(y - 1, 0); converged && ny <= std::min(y + 1, height - 1); ++ny) {
+        for (int nx = std::max(x - 1, 0); converged && nx <= std::min(x + 1, width - 1); ++nx) {
+          converged = error[ny*width + nx] <= limit;
+        }
+      }
+      active = converged ? 0 : 1;
+      remaining += active;
+    }
+  }
+  return remaining;
+}
+
+/// samples per pixel, black for none to white for the most
+static void saveHeatmap(char const *filename, int width, int height, accumulation_t const& acc) {
+  bitmap_t bm = createRenderTarget(width, height);
+  int const most = std::max(1, *std::max_element(acc.samples.begin(), acc.samples.end()));
+  for (int i = 0; i < width*height; ++i) {
+    real_t const t = real_t(acc.samples[i]) / real_t(most) * 3;
+    bm.pixels[i] = clamp(vec3_t(t, t - 1, t - 2), 0, 1);
+  }
+  if (!saveRenderTarget(filename, bm)) {
+    fprintf(stderr, "error: can not write heatmap %s\n", filename);
+  }
+  deleteRenderTarget(&bm);
+}
+
+void renderProgressive(bitmap_t *target, Scene const& scene, option_t const& opt,
+                       progressive_t const& settings) {
+  int const pixels = target->width*target->height;
+  accumulation_t acc;
+  acc.sum.assign(pixels, vec3_t(0, 0, 0));
+  acc.mean.assign(pixels, vec3_t(0, 0, 0));
+  acc.m2.assign(pixels, vec3_t(0, 0, 0));
+  acc.samples.assign(pixels, 0);
+  acc.passes.assign(pixels, 0);
+  acc.active.assign(pixels, 1);
+  bitmap_t pass = createRenderTarget(target->width, target->height);
+  SnapshotWriter writer(settings.output, target->width, target->height, settings.snapshot);
+
+  auto const start = std::chrono::steady_clock::now();
+  double longest = 0.0;
+  double noise = std::numeric_limits<double>::infinity();
+  int remaining = pixels;
+  char const *reason = "";
+  for (;;) {
+    if (settings.max_samples > 0 && acc.total >= settings.max_samples) {
+      reason = "sample limit";
+      break;
+    }
+    double const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (settings.time_limit > 0.0 && acc.pass_count > 0 && elapsed + longest > settings.time_limit) {
+      reason = "time limit";
+      break;
+    }
+    if (settings.noise > 0.0 && (settings.adaptive ? remaining == 0 : noise <= settings.noise)) {
+      reason = "noise target";
+      break;
+    }
+
+    option_t pass_opt = opt;
+    pass_opt.samples = settings.pass;
+    if (settings.max_samples > 0) {
+      pass_opt.samples = std::min(pass_opt.samples, settings.max_samples - acc.total);
+    }
+    auto const pass_start = std::chrono::steady_clock::now();
+    renderSamples(&pass, scene, pass_opt, acc.total, acc.active.data());
+    longest = std::max(longest, std::chrono::duration<double>(std::chrono::steady_clock::now() - pass_start).count());
+    accumulate(pass, pass_opt.samples, &acc);
+    noise = noiseEstimate(acc);
+    if (settings.adaptive) {
+      remaining = retirePixels(target->width, target->height, settings.noise, &acc);
+    }
+
+    for (int i = 0; i < pixels; ++i) {
+      target->pixels[i] = acc.sum[i] * (real_t(1) / real_t(std::max(acc.samples[i], 1)));
+    }
+    writer.publish(*target);
+    fprintf(stdout, "pass %d: %d samples, noise %.3f, %d pixels active    \r",
+            acc.pass_count, acc.total, noise, remaining);
+    fflush(stdout);
+  }
+  deleteRenderTarget(&pass);
+  long long sum = 0;
+  for (int n : acc.samples) {
+    sum += n;
+  }
+  fprintf(stdout, "done, %s: %d passes, %.1f samples per pixel on average, up to %d, noise %.3f\n",
+          reason, acc.pass_count, double(sum) / double(std::max(pixels, 1)), acc.total, noise);
+  if (settings.heatmap) {
+    saveHeatmap(settings.heatmap, target->width, target->height, acc);
+  }
+}
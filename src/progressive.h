@@ -0,0 +1,28 @@
+#pragma once
+#include "render.h"
+
+/// when progressive rendering stops and where it shows its progress. every
+/// limit is off at 0, at least one of them has to be set.
+struct progressive_t {
+  int         pass;        // samples per pixel added by one pass
+  int         max_samples; // samples per pixel to stop at
+  double      time_limit;  // seconds the render must not run over
+  double      noise;       // estimated rmse in 8 bit ppm units to stop at
+  double      snapshot;    // seconds between intermediate images
+  bool        adaptive;    // retire pixels once their own error is below noise
+  char const *output;      // file the intermediate images are written to
+  char const *heatmap;     // file for the samples per pixel, or null
+};
+
+/// renders passes of settings.pass samples per pixel into an hdr accumulation
+/// buffer until a limit is reached, and stores the mean in target. a pass is
+/// only started if it is expected to finish within the time limit. the noise
+/// estimate is the standard error of the pixels over the passes; with qmc
+/// samplers passes are stratified against each other, so it errs on the high
+/// side. adaptive rendering applies the noise target to every pixel instead
+/// of the whole image: it stops spending passes on pixels below it and ends
+/// once none is left, so samples go where the image is still noisy.
+/// intermediate images are written by a separate thread, the passes only hand
+/// them a copy.
+void renderProgressive(bitmap_t *target, Scene const& scene, option_t const& opt,
+                       progressive_t const& settings);
@@ -1,6 +1,15 @@
 #include "render.h"
+#include "sampler.h"
+#include "filter.h"
+#include "scheduler.h"
+#include "simd.h"
 #include <stdio.h>
-#include <random>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <tuple>
+#include <utility>
 
 bitmap_t createRenderTarget(int width, int height) {
   bitmap_t rt = {
@@ -47,49 +56,315 @@ bool saveRenderTarget(char const* filename, bitmap_t const& bm) {
   return true;
 }
 
-/// @brief: render the scene without tracing, for testing the scene graph
-void renderLowQuality(bitmap_t *target, Scene const& scene, option_t const& opt) {
+bool compareRenderTarget(char const* reference, bitmap_t const& bm, image_diff_t *diff) {
+  FILE* ppm = fopen(reference, "r");
+  if (!ppm) {
+    return false;
+  }
+  int width, height, maxval;
+  if (fscanf(ppm, "P3 %d %d %d", &width, &height, &maxval) != 3 ||
+      width != bm.width || height != bm.height || maxval != 255) {
+    fclose(ppm);
+    return false;
+  }
+
+  double sum = 0.0;
+  *diff = image_diff_t{ 0.0, 0.0, 0, 0 };
+  for (size_t i=0, len=bm.width*bm.height; i<len; ++i) {
+    int ref[3];
+    if (fscanf(ppm, "%d %d %d", ref, ref+1, ref+2) != 3) {
+      fclose(ppm);
+      return false;
+    }
+    int const value[3] = { tobyte(bm.pixels[i].x), tobyte(bm.pixels[i].y), tobyte(bm.pixels[i].z) };
+    bool differs = false;
+    for (int c = 0; c < 3; ++c) {
+      int const d = std::abs(value[c] - ref[c]);
+      sum += double(d*d);
+      diff->max_error = std::max(diff->max_error, d);
+      differs = differs || d != 0;
+    }
+    diff->pixels += differs ? 1 : 0;
+  }
+  fclose(ppm);
+
+  diff->rmse = std::sqrt(sum / (3.0*bm.width*bm.height));
+  diff->psnr = diff->rmse > 0.0 ? 20.0*std::log10(255.0 / diff->rmse)
+                                : std::numeric_limits<double>::infinity();
+  return true;
+}
+
+/// pinhole camera, turns image positions into primary rays
+struct view_t {
+  vec3_t position;
+  vec3_t forward;
+  vec3_t up;
+  vec3_t right;
+  real_t focal_distance_pixel;
+  int    width;
+  int    height;
+};
+
+static view_t setupView(bitmap_t const* target, Scene const& scene) {
   // first calculate how the ray casts
   real_t const fovy = scene.camera.fov;
-  real_t const fovx = fovy / target->height * target->width;
-  real_t const focal_distance_pixel = target->height / std::tan(fovy / real_t(2));
-
-  vec3_t const forward = normalize(scene.camera.direction);
-  vec3_t const up = normalize(scene.camera.up);
-  vec3_t const right = cross(up, forward);
-
-  for(int ix=0; ix<target->width; ++ix) {
-    for(int iy=0; iy<target->height; ++iy) {
-      // screen space
-      real_t const sx = (real_t(ix) - real_t(target->width) / real_t(2));
-      real_t const sy = (real_t(iy) - real_t(target->height) / real_t(2));
-      vec3_t const spos(sx, -sy, focal_distance_pixel);
-
-      // world space
-      real_t const wx = dot(spos, right);
-      real_t const wy = dot(spos, up);
-      real_t const wz = dot(spos, forward);
-      vec3_t const dir = normalize(vec3_t(wx, wy, wz));
-
-      ray_t ray = {
-        scene.camera.position,
-        dir
-      };
-      real_t minSquareDist = std::numeric_limits<real_t>::max();
-      real_t squareDist;
-      for (Geometry* g:scene.geometry_list) {
-        intersection_t intersection;
-        if (g->intersect(ray, &intersection) &&
-            (squareDist=lengthSquare(intersection.intersection[0]-ray.origin))<minSquareDist) { // TODO: transparency
-          minSquareDist = squareDist;
-          target->pixels[iy*target->width + ix] = intersection.material->color * std::abs(dot(normalize(vec3_t(0,-1,1)), intersection.normal[0]));
-          // target->pixels[iy*target->width + ix] = normalize(intersection.normal[0]*real_t(0.5) + vec3_t(0.5, 0.5, 0.5));
-        }
+  view_t view;
+  view.position = scene.camera.position;
+  view.focal_distance_pixel = target->height / std::tan(fovy / real_t(2));
+  view.forward = normalize(scene.camera.direction);
+  view.up = normalize(scene.camera.up);
+  view.right = cross(view.up, view.forward);
+  view.width = target->width;
+  view.height = target->height;
+  return view;
+}
+
+static ray_t primaryRay(view_t const& view, real_t x, real_t y) {
+  // screen space
+  real_t const sx = x - real_t(view.width) / real_t(2);
+  real_t const sy = y - real_t(view.height) / real_t(2);
+  vec3_t const spos(sx, -sy, view.focal_distance_pixel);
+
+  // world space
+  real_t const wx = dot(spos, view.right);
+  real_t const wy = dot(spos, view.up);
+  real_t const wz = dot(spos, view.forward);
+  vec3_t const dir = normalize(vec3_t(wx, wy, wz));
+
+  return ray_t{ view.position, dir };
+}
+
+/// pixel block traced by one packet, as square as possible
+static void blockSize(int pixels, int *bw, int *bh) {
+  *bw = 1;
+  *bh = 1;
+  while (*bw * *bh < pixels) {
+    if (*bw <= *bh) {
+      *bw *= 2;
+    } else {
+      *bh *= 2;
+    }
+  }
+}
+
+struct primary_t {
+  ray_t ray;
+  hit_t hit;
+  bool  found;
+};
+
+struct primary_stats_t {
+  long long rays;
+  double    seconds;
+};
+
+struct path_stats_t {
+  long long paths;
+  long long segments; // rays traced after the primary ones
+  long long extended; // of those, rays of the wavefront extend stage
+  long long visits;   // bvh node boxes they tested
+  double    seconds;  // thread time of the extend stage, reordering included
+};
+
+/// closest hits of out[i].ray, traced in packets of packet_size, or one by one
+/// if it is 1. adds the bvh node boxes tested to visits if given.
+static void intersectAll(Scene const& scene, primary_t *out, int count, int packet_size,
+                         long long *visits = nullptr) {
+  if (packet_size <= 1) {
+    for (int i = 0; i < count; ++i) {
+      out[i].found = scene.intersect(out[i].ray, std::numeric_limits<real_t>::max(), &out[i].hit, visits);
+    }
+  } else {
+    for (int first = 0; first < count; first += packet_size) {
+      int const n = std::min(packet_size, count - first);
+      ray_packet_t packet;
+      hit_packet_t hits;
+      packet.size = (n + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+      for (int i = 0; i < packet.size; ++i) {
+        ray_t const& ray = out[first + std::min(i, n - 1)].ray;
+        packet.ox[i] = ray.origin.x;
+        packet.oy[i] = ray.origin.y;
+        packet.oz[i] = ray.origin.z;
+        packet.dx[i] = ray.direction.x;
+        packet.dy[i] = ray.direction.y;
+        packet.dz[i] = ray.direction.z;
+        hits.t[i] = i < n ? std::numeric_limits<real_t>::max() : real_t(-1); // padding never hits
+        hits.id[i] = -1;
+      }
+      scene.intersect(packet, &hits, visits);
+      for (int i = 0; i < n; ++i) {
+        out[first + i].found = hits.id[i] >= 0;
+        out[first + i].hit.t = hits.t[i];
+        out[first + i].hit.id = hits.id[i];
       }
     }
   }
 }
 
+/// closest hits of the primary rays through the image positions xs/ys
+static void tracePrimary(Scene const& scene, view_t const& view, real_t const* xs, real_t const* ys,
+                         int count, int packet_size, primary_t *out, primary_stats_t *stats) {
+  auto const start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < count; ++i) {
+    out[i].ray = primaryRay(view, xs[i], ys[i]);
+  }
+  intersectAll(scene, out, count, packet_size);
+  stats->rays += count;
+  stats->seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static void reportPrimary(primary_stats_t const& stats, int packet_size) {
+  fprintf(stdout, "primary rays: %lld in %.2fms thread time, %.2f Mrays/s per thread (packet size %d, %d lanes)\n",
+          stats.rays, stats.seconds * 1000.0, stats.rays / std::max(stats.seconds, 1e-9) * 1e-6,
+          packet_size, SIMD_WIDTH);
+}
+
+static void reportPaths(path_stats_t const& stats) {
+  fprintf(stdout, "paths: %lld, %.2f segments on average\n",
+          stats.paths, double(stats.segments) / double(std::max(stats.paths, 1LL)));
+  if (stats.extended > 0) {
+    fprintf(stdout, "extended rays: %lld in %.2fms thread time, %.2f Mrays/s per thread, %.1f bvh nodes per ray\n",
+            stats.extended, stats.seconds * 1000.0, stats.extended / std::max(stats.seconds, 1e-9) * 1e-6,
+            double(stats.visits) / double(stats.extended));
+  }
+}
+
+/// pixels [x0, x1) x [y0, y1) of the target
+struct tile_t {
+  int x0, y0;
+  int x1, y1;
+};
+
+/// shading order of the wavefront paths: by primitive type, then material
+struct shade_key_t {
+  int               type;
+  material_t const *material;
+  int               path;
+};
+
+/// states of the paths of a wavefront, one array per field, indexed by path
+struct wavefront_t {
+  std::vector<ray_t>          ray;
+  std::vector<hit_t>          hit;
+  std::vector<intersection_t> intr;
+  std::vector<vec3_t>         throughput;
+  std::vector<vec3_t>         color;
+  std::vector<real_t>         pdf;    // of the reflection, see scatter()
+  std::vector<int>            from;   // geometry the ray leaves
+  std::vector<int>            bounce; // next bounce
+  std::vector<int>            queue;  // paths still alive
+  std::vector<shade_key_t>    keys;
+  std::vector<std::pair<uint64_t, int>> order; // ray keys of the extend stage
+};
+
+/// per thread state of the tile renderers. a thread accumulates into its own
+/// tile buffer, which is copied into the target once the tile is finished.
+struct worker_t {
+  std::vector<vec3_t>    tile;    // row major, tile_t::x1 - x0 wide
+  std::vector<real_t>    xs, ys;  // image positions of the current block
+  std::vector<int>       pixel;   // their index into tile
+  std::vector<uint32_t>  index;   // their sample index
+  std::vector<primary_t> primary;
+  std::vector<primary_t> segment; // next segments of the wavefront paths
+  wavefront_t            wave;
+  primary_stats_t        stats;
+  path_stats_t           paths;
+};
+
+/// splits the target into opt.tile sized tiles and shades them with
+/// shade(tile, worker) on opt.threads threads, sums up the worker stats
+template <class ShadeTile>
+static void renderTiles(bitmap_t *target, option_t const& opt, bool progress, ShadeTile const& shade,
+                        primary_stats_t *primary, path_stats_t *paths) {
+  int const size = std::max(opt.tile, 1);
+  std::vector<tile_t> tiles;
+  for (int y = 0; y < target->height; y += size) {
+    for (int x = 0; x < target->width; x += size) {
+      tiles.push_back(tile_t{ x, y, std::min(x + size, target->width), std::min(y + size, target->height) });
+    }
+  }
+
+  int const threads = opt.threads > 0 ? opt.threads : hardwareThreads();
+  std::vector<worker_t> workers(threads);
+  for (worker_t& w : workers) {
+    w.tile.resize(size*size);
+    w.stats = primary_stats_t{ 0, 0.0 };
+    w.paths = path_stats_t{ 0, 0, 0, 0, 0.0 };
+  }
+
+  std::atomic<int> done(0);
+  std::mutex report;
+  parallelFor(int(tiles.size()), threads, [&](int item, int thread) {
+    tile_t const& tile = tiles[item];
+    worker_t& w = workers[thread];
+    int const tw = tile.x1 - tile.x0;
+    std::fill(w.tile.begin(), w.tile.end(), vec3_t(0, 0, 0));
+    shade(tile, &w);
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      std::copy(w.tile.begin() + (y - tile.y0)*tw, w.tile.begin() + (y - tile.y0 + 1)*tw,
+                target->pixels + y*target->width + tile.x0);
+    }
+    int const finished = ++done;
+    if (progress) {
+      std::lock_guard<std::mutex> guard(report);
+      fprintf(stdout, "rendering ... %.2f%%    \r", float(finished*100) / float(tiles.size()));
+    }
+  });
+
+  *primary = primary_stats_t{ 0, 0.0 };
+  *paths = path_stats_t{ 0, 0, 0, 0, 0.0 };
+  for (worker_t const& w : workers) {
+    primary->rays += w.stats.rays;
+    primary->seconds += w.stats.seconds;
+    paths->paths += w.paths.paths;
+    paths->segments += w.paths.segments;
+    paths->extended += w.paths.extended;
+    paths->visits += w.paths.visits;
+    paths->seconds += w.paths.seconds;
+  }
+}
+
+/// @brief: render the scene without tracing, for testing the scene graph
+void renderLowQuality(bitmap_t *target, Scene const& scene, option_t const& opt) {
+  view_t const view = setupView(target, scene);
+  int bw, bh;
+  blockSize(opt.packet, &bw, &bh);
+
+  primary_stats_t stats;
+  path_stats_t paths;
+  renderTiles(target, opt, false, [&](tile_t const& tile, worker_t *w) {
+    int const tw = tile.x1 - tile.x0;
+    w->xs.resize(bw*bh);
+    w->ys.resize(bw*bh);
+    w->pixel.resize(bw*bh);
+    w->primary.resize(bw*bh);
+    for (int bx = tile.x0; bx < tile.x1; bx += bw) {
+      for (int by = tile.y0; by < tile.y1; by += bh) {
+        int count = 0;
+        for (int ix = bx; ix < std::min(bx + bw, tile.x1); ++ix) {
+          for (int iy = by; iy < std::min(by + bh, tile.y1); ++iy) {
+            w->xs[count] = real_t(ix);
+            w->ys[count] = real_t(iy);
+            w->pixel[count] = (iy - tile.y0)*tw + (ix - tile.x0);
+            ++count;
+          }
+        }
+        tracePrimary(scene, view, w->xs.data(), w->ys.data(), count, opt.packet, w->primary.data(), &w->stats);
+
+        for (int i = 0; i < count; ++i) {
+          if (w->primary[i].found) { // TODO: transparency
+            intersection_t intersection;
+            scene.surface(w->primary[i].ray, w->primary[i].hit, &intersection);
+            w->tile[w->pixel[i]] = intersection.material->color * std::abs(dot(normalize(vec3_t(0,-1,1)), intersection.normal));
+            // w->tile[w->pixel[i]] = normalize(intersection.normal*real_t(0.5) + vec3_t(0.5, 0.5, 0.5));
+          }
+        }
+      }
+    }
+  }, &stats, &paths);
+  reportPrimary(stats, opt.packet);
+}
+
 // taken from unreal engine
 static vec3_t importanceSampleGGX(real_t randPhi, real_t randTheta, real_t roughness) {
   real_t const m = roughness * roughness;
@@ -131,20 +406,27 @@ static vec3_t importanceSampleCos(real_t randPhi, real_t randTheta, real_t rough
   );
 }
 
-// taken from unreal engine
-static vec3_t tangentToWorld(vec3_t vec, vec3_t normal) {
-  vec3_t const up = std::abs(normal.z) < 0.999 ? vec3_t(0, 0, 1) : vec3_t(1, 0, 0);
-  vec3_t const x = normalize(cross(up, normal));
-  vec3_t const y = cross(normal, x);
-  return x*vec.x + y*vec.y + normal*vec.z;
+/// shading frame of the hit, mirrored to the side the ray comes from
+static vec3_t tangentToWorld(vec3_t vec, intersection_t const& intr, bool back) {
+  real_t const s = back ? real_t(-1) : real_t(1);
+  return intr.tangent*(s*vec.x) + intr.bitangent*vec.y + intr.normal*(s*vec.z);
 }
 
-template <class RandomFunction>
-static ray_t reflect(ray_t const& ray, vec3_t const& pos, vec3_t const& normal, material_t const* material, RandomFunction &f) {
+/// reflects every ray the same way, so paths need no samples there
+static bool isMirror(material_t const* material) {
+  return material->roughness <= real_t(1e-6);
+}
+
+static ray_t reflect(ray_t const& ray, intersection_t const& intr, Sampler &sampler) {
+  vec3_t const& pos = intr.position;
+  vec3_t const& normal = intr.normal;
+  material_t const* material = intr.material;
   real_t const cosangle = dot(ray.direction, normal);
   vec3_t const refdir = ray.direction - normal*cosangle*real_t(2);
   if (material->roughness > real_t(1e-6)) {
-    vec3_t const micro_normal = tangentToWorld(importanceSampleGGX(f(), f(), material->roughness), cosangle<0?normal:-normal);
+    real_t const u = sampler.next();
+    real_t const v = sampler.next();
+    vec3_t const micro_normal = tangentToWorld(importanceSampleGGX(u, v, material->roughness), intr, cosangle>=0);
     vec3_t const ref = ray.direction - real_t(2) * dot(ray.direction, micro_normal)*micro_normal;
     return ray_t{ pos, normalize(ref) };
   } else {
@@ -152,90 +434,377 @@ static ray_t reflect(ray_t const& ray, vec3_t const& pos, vec3_t const& normal,
   }
 }
 
-template <class RandomFunction>
-static vec3_t radiance(ray_t const& ray, Scene const& scene, int depth, RandomFunction &f) {
-  if (depth < 0) {
+/// density of reflect() choosing direction wi towards the side of normal,
+/// per unit solid angle: the ggx density of the half vector times the
+/// jacobian of reflecting about it. reflect() weighs every direction by the
+/// surface color, so color times this density is the brdf times cosine.
+static real_t reflectPdf(vec3_t const& wo, vec3_t const& wi, vec3_t const& normal, real_t roughness) {
+  vec3_t const h = normalize(wo + wi);
+  real_t const cos_h = dot(h, normal);
+  if (!(cos_h > real_t(0))) {
+    return real_t(0);
+  }
+  real_t const m = roughness * roughness;
+  real_t const m2 = m * m;
+  real_t const d = cos_h * cos_h * (m2 - 1) + 1;
+  return m2 * cos_h / (PI * d * d * real_t(4) * std::abs(dot(wo, h)));
+}
+
+/// power heuristic weight of a sample drawn with density pdf, against the
+/// other strategy drawing it with density other, both per unit solid angle
+static real_t powerHeuristic(real_t pdf, real_t other) {
+  real_t const r = other / pdf;
+  return real_t(1) / (real_t(1) + r * r);
+}
+
+/// light of one emitter point, chosen by area, reflected at intr towards
+/// -ray.direction and not yet weighted by the surface color. the point is
+/// weighted against reflect() finding it, see radiance(). emitters that
+/// cannot be sampled, the surface itself and directions below the surface
+/// are left to reflect() alone.
+static vec3_t directLight(ray_t const& ray, int id, intersection_t const& intr, Scene const& scene,
+                          Sampler &sampler) {
+  real_t const u = sampler.next();
+  real_t const v = sampler.next();
+  emitter_sample_t light;
+  if (!scene.sampleEmitter(u, v, sampler.next(), &light) || light.id == id) {
+    return vec3_t(0, 0, 0);
+  }
+  vec3_t const normal = dot(ray.direction, intr.normal) >= 0 ? -intr.normal : intr.normal;
+  vec3_t const d = light.position - intr.position;
+  real_t const distance = length(d);
+  vec3_t const wi = d * (real_t(1) / distance);
+  real_t const cos_light = std::abs(dot(light.normal, wi));
+  if (!(dot(wi, normal) > real_t(0)) || !(cos_light > real_t(0))) {
     return vec3_t(0, 0, 0);
+  }
+  real_t const pdf = reflectPdf(-ray.direction, wi, normal, intr.material->roughness);
+  if (!(pdf > real_t(0)) || !std::isfinite(pdf)) {
+    return vec3_t(0, 0, 0);
+  }
+  if (scene.occluded(ray_t{ intr.position, wi }, real_t(1e-4), distance - real_t(1e-4))) {
+    return vec3_t(0, 0, 0);
+  }
+  real_t const light_pdf = light.pdf * distance * distance / cos_light;
+  return light.emission * (pdf / light_pdf * powerHeuristic(light_pdf, pdf));
+}
+
+/// sampler dimensions of the position on the film, ahead of the bounces
+static const uint32_t FILM_DIMENSIONS = 2;
+
+/// sampler dimensions reserved per bounce: two for reflect(), three for
+/// directLight() and one for russian roulette
+static const uint32_t DIMENSIONS_PER_BOUNCE = 6;
+
+/// applies the vertex intr that the path reached along ray, leaving geometry
+/// from where reflect() had density pdf, see scatter(). emitters add their
+/// color and reflect like a white surface, other surfaces scale the
+/// throughput by their color. emitters the reflection finds are weighted
+/// against the emitter sample of the previous vertex, so narrow lobes rely
+/// on reflect() and rough ones on the emitter samples.
+static void arrive(ray_t const& ray, hit_t const& hit, intersection_t const& intr, int from, real_t pdf,
+                   Scene const& scene, vec3_t *throughput, vec3_t *color) {
+  if (intr.material->emit) {
+    real_t weight = real_t(1);
+    real_t const cos_light = std::abs(dot(intr.normal, ray.direction));
+    if (pdf > real_t(0) && hit.id != from && cos_light > real_t(0)) {
+      weight = powerHeuristic(pdf, scene.emitterPdf(hit.id) * hit.t * hit.t / cos_light);
+    }
+    *color += *throughput * intr.material->color * weight;
   } else {
-    real_t closest2 = std::numeric_limits<real_t>::max();
-    vec3_t color(0, 0, 0);
-    for (Geometry* g : scene.geometry_list) {
-      intersection_t intr;
-      real_t distance2;
-      if (g->intersect(ray, &intr) && (distance2 = lengthSquare(intr.intersection[0] - ray.origin)) < closest2) {
-        closest2 = distance2;
-        ray_t ref = reflect(ray, intr.intersection[0], intr.normal[0], intr.material, f);
-        ref.origin += ref.direction*real_t(1e-4);
-        color = radiance(ref, scene, depth - 1, f);
-        if (intr.material->emit) {
-          color = color + intr.material->color;
-        } else {
-          color = color * intr.material->color;
-        }
+    *throughput = *throughput * intr.material->color;
+  }
+}
+
+/// leaves the vertex intr of the given bounce, reached along ray: russian
+/// roulette, the emitter sample, which is added to color, and the reflection,
+/// which replaces ray. pdf is set to the density of the reflection, zero
+/// where no emitter sample competes. false if the path ends here.
+/// every vertex but a mirror samples one emitter point directly. after
+/// opt.rr_depth bounces paths survive with probability max(throughput) and
+/// are weighted by its inverse, which keeps the estimate unbiased.
+static bool scatter(int bounce, hit_t const& hit, intersection_t const& intr, Scene const& scene,
+                    option_t const& opt, Sampler &sampler, ray_t *ray, vec3_t *throughput,
+                    vec3_t *color, real_t *pdf) {
+  real_t const strength = std::max(throughput->x, std::max(throughput->y, throughput->z));
+  if (lengthSquare(intr.normal) == real_t(0) || !(strength > real_t(0))) {
+    return false; // inside a solid, or nothing the path finds can contribute
+  }
+  uint32_t const dimension = FILM_DIMENSIONS + uint32_t(bounce) * DIMENSIONS_PER_BOUNCE;
+  if (bounce >= opt.rr_depth) {
+    real_t const survive = std::min(strength, real_t(0.95));
+    sampler.seek(dimension + 5);
+    if (sampler.next() >= survive) {
+      return false;
+    }
+    *throughput = *throughput * (real_t(1) / survive);
+  }
+  bool const mirror = isMirror(intr.material);
+  if (!mirror) {
+    sampler.seek(dimension + 2);
+    *color += *throughput * directLight(*ray, hit.id, intr, scene, sampler);
+  }
+  sampler.seek(dimension);
+  ray_t const next = reflect(*ray, intr, sampler);
+  *pdf = real_t(0);
+  if (!mirror && dot(next.direction, intr.normal) * dot(ray->direction, intr.normal) < 0) {
+    vec3_t const normal = dot(ray->direction, intr.normal) >= 0 ? -intr.normal : intr.normal;
+    *pdf = reflectPdf(-ray->direction, next.direction, normal, intr.material->roughness);
+  }
+  *ray = next;
+  if (bounce > 0) { // the reflection of the primary hit starts on its surface
+    ray->origin += ray->direction*real_t(1e-4);
+  }
+  return true;
+}
+
+/// light leaving the primary hit intr towards the camera, traced depth first,
+/// one bounce after the other. the primary hit only filters by its color.
+static vec3_t radiance(ray_t ray, hit_t hit, intersection_t intr, Scene const& scene,
+                       option_t const& opt, Sampler &sampler, path_stats_t *stats) {
+  vec3_t color(0, 0, 0);
+  vec3_t throughput = intr.material->color;
+  for (int bounce = 0; bounce <= opt.depth; ++bounce) {
+    real_t pdf;
+    if (!scatter(bounce, hit, intr, scene, opt, sampler, &ray, &throughput, &color, &pdf)) {
+      break;
+    }
+    int const from = hit.id;
+    ++stats->segments;
+    if (!scene.intersect(ray, std::numeric_limits<real_t>::max(), &hit)) {
+      break;
+    }
+    scene.surface(ray, hit, &intr);
+    arrive(ray, hit, intr, from, pdf, scene, &throughput, &color);
+  }
+  return color;
+}
+
+/// sorts the queued rays by the direction octant and then along a morton curve
+/// through their origins, so neighbouring rays, and the rays of a packet,
+/// tend to visit the same bvh nodes in the same order
+static void reorderRays(wavefront_t& wave) {
+  aabb_t bounds;
+  for (int p : wave.queue) {
+    bounds = merge(bounds, wave.ray[p].origin);
+  }
+  wave.order.clear();
+  for (int p : wave.queue) {
+    vec3_t const& d = wave.ray[p].direction;
+    uint64_t const octant = (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+    wave.order.push_back(std::make_pair((octant << 30) | mortonCode(wave.ray[p].origin, bounds), p));
+  }
+  std::sort(wave.order.begin(), wave.order.end());
+  for (size_t k = 0; k < wave.order.size(); ++k) {
+    wave.queue[k] = wave.order[k].second;
+  }
+}
+
+/// light of the paths starting at w->primary[0, count), like radiance(), but
+/// all paths advance a bounce at a time and every stage runs over the whole
+/// wavefront before the next one starts: paths are shaded grouped by
+/// primitive type and material, the reflected rays of the survivors are
+/// compacted and then extended in packets of opt.packet, which are applied
+/// by arrive(). the light of path p ends up in w->wave.color[p].
+static void traceWavefront(Scene const& scene, option_t const& opt, tile_t const& tile, int width,
+                           int count, worker_t *w) {
+  wavefront_t& wave = w->wave;
+  wave.ray.resize(count);
+  wave.hit.resize(count);
+  wave.intr.resize(count);
+  wave.throughput.resize(count);
+  wave.color.assign(count, vec3_t(0, 0, 0));
+  wave.pdf.resize(count);
+  wave.from.resize(count);
+  wave.bounce.resize(count);
+  wave.queue.clear();
+  for (int p = 0; p < count; ++p) {
+    primary_t const& primary = w->primary[p];
+    if (!primary.found) {
+      continue;
+    }
+    wave.ray[p] = primary.ray;
+    wave.hit[p] = primary.hit;
+    wave.bounce[p] = 0;
+    scene.surface(primary.ray, primary.hit, &wave.intr[p]);
+    wave.throughput[p] = wave.intr[p].material->color;
+    wave.queue.push_back(p);
+    ++w->paths.paths;
+  }
+
+  int const tw = tile.x1 - tile.x0;
+  Sampler sampler(opt.sampler, opt.seed);
+  while (!wave.queue.empty()) {
+    // shade
+    wave.keys.clear();
+    for (int p : wave.queue) {
+      wave.keys.push_back(shade_key_t{ scene.geometry_list[wave.hit[p].id]->type(), wave.intr[p].material, p });
+    }
+    std::sort(wave.keys.begin(), wave.keys.end(), [](shade_key_t const& a, shade_key_t const& b) {
+      return std::tie(a.type, a.material, a.path) < std::tie(b.type, b.material, b.path);
+    });
+    wave.queue.clear();
+    for (shade_key_t const& key : wave.keys) {
+      int const p = key.path;
+      int const local = w->pixel[p];
+      sampler.start(uint32_t((tile.y0 + local / tw)*width + tile.x0 + local % tw), w->index[p]);
+      if (wave.bounce[p] > opt.depth ||
+          !scatter(wave.bounce[p], wave.hit[p], wave.intr[p], scene, opt, sampler,
+                   &wave.ray[p], &wave.throughput[p], &wave.color[p], &wave.pdf[p])) {
+        continue;
+      }
+      wave.from[p] = wave.hit[p].id;
+      ++wave.bounce[p];
+      wave.queue.push_back(p);
+    }
+
+    // extend
+    auto const start = std::chrono::high_resolution_clock::now();
+    int const live = int(wave.queue.size());
+    if (opt.reorder) {
+      reorderRays(wave);
+    }
+    w->segment.resize(live);
+    for (int k = 0; k < live; ++k) {
+      w->segment[k].ray = wave.ray[wave.queue[k]];
+    }
+    intersectAll(scene, w->segment.data(), live, opt.packet, &w->paths.visits);
+    w->paths.segments += live;
+    w->paths.extended += live;
+    w->paths.seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    int kept = 0;
+    for (int k = 0; k < live; ++k) {
+      int const p = wave.queue[k];
+      if (!w->segment[k].found) {
+        continue;
       }
+      wave.hit[p] = w->segment[k].hit;
+      scene.surface(wave.ray[p], wave.hit[p], &wave.intr[p]);
+      arrive(wave.ray[p], wave.hit[p], wave.intr[p], wave.from[p], wave.pdf[p], scene,
+             &wave.throughput[p], &wave.color[p]);
+      wave.queue[kept++] = p;
     }
-    return color;
+    wave.queue.resize(kept);
   }
 }
 
-/// properly renders the scene
-void render(bitmap_t *target, Scene const& scene, option_t const& opt) {
-  // first calculate how the ray casts
-  real_t const fovy = scene.camera.fov;
-  real_t const fovx = fovy / target->height * target->width;
-  real_t const focal_distance_pixel = target->height / std::tan(fovy / real_t(2));
-
-  vec3_t const forward = normalize(scene.camera.direction);
-  vec3_t const up = normalize(scene.camera.up);
-  vec3_t const right = cross(up, forward);
-
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<real_t> dist(real_t(0), real_t(1));
-  auto random = [&gen, &dist]()->real_t {
-    return dist(gen);
-  };
+/// the sub pixels of a pixel draw their samples from their own block of
+/// 2^SUBPIXEL_SAMPLE_BITS indices of the pixel's sequence
+static const int SUBPIXEL_SAMPLE_BITS = 24;
 
-  for (int ix = 0; ix<target->width; ++ix) {
-    for (int iy = 0; iy<target->height; ++iy) {
-      // super sampling
-      for (int superx = 0; superx < 2; ++superx) for (int supery = 0; supery < 2; ++supery) {
-        // screen space
-        real_t const sx = real_t(ix + (superx - 0.5)/2.0 - real_t(target->width) / real_t(2));
-        real_t const sy = real_t(iy + (supery - 0.5)/2.0 - real_t(target->height) / real_t(2));
-        vec3_t const spos(sx, -sy, focal_distance_pixel);
-
-        // world space
-        real_t const wx = dot(spos, right);
-        real_t const wy = dot(spos, up);
-        real_t const wz = dot(spos, forward);
-        vec3_t const dir = normalize(vec3_t(wx, wy, wz));
-
-        ray_t ray = {
-          scene.camera.position,
-          dir
-        };
-        real_t minSquareDist = std::numeric_limits<real_t>::max();
-        real_t squareDist;
-        vec3_t pixelColor(0, 0, 0);
-        for (Geometry* g : scene.geometry_list) {
-          intersection_t intersection;
-          if (g->intersect(ray, &intersection) &&
-            (squareDist = lengthSquare(intersection.intersection[0] - ray.origin)) < minSquareDist) {
-            minSquareDist = squareDist;
-            pixelColor = vec3_t(0, 0, 0);
-
-            for (int i = 0; i < opt.samples; ++i) {
-              ray_t ref = reflect(ray, intersection.intersection[0], intersection.normal[0], intersection.material, random);
-              pixelColor += radiance(ref, scene, opt.depth, random) * intersection.material->color * real_t(1.0 / opt.samples);
+/// samples [first, first + opt.samples) of every sub pixel of every pixel that
+/// is active, or of all if active is null, optionally reporting progress and
+/// ray statistics. every sample traces its own primary ray, jittered within
+/// its sub pixel and warped by the reconstruction filter. with
+/// opt.wavefront, a sample of the whole tile is traced as one wavefront.
+static void renderRange(bitmap_t *target, Scene const& scene, option_t const& opt, int first,
+                        uint8_t const *active, bool report) {
+  view_t const view = setupView(target, scene);
+  Filter const filter(opt.filter);
+
+  // a packet covers the sub pixels of a block of pixels, one sample each
+  int const n = opt.subpixels;
+  int bw, bh;
+  blockSize(std::max(opt.packet / (n*n), 1), &bw, &bh);
+  real_t const weight = real_t(1) / real_t(n*n*opt.samples);
+
+  primary_stats_t stats;
+  path_stats_t paths;
+  renderTiles(target, opt, report, [&](tile_t const& tile, worker_t *w) {
+    Sampler sampler(opt.sampler, opt.seed);
+    int const tw = tile.x1 - tile.x0;
+    int const size = opt.wavefront ? tw*(tile.y1 - tile.y0)*n*n : bw*bh*n*n;
+    w->xs.resize(size);
+    w->ys.resize(size);
+    w->pixel.resize(size);
+    w->index.resize(size);
+    w->primary.resize(size);
+
+    // image positions of sample i of the block at bx, by, appended at count
+    auto generate = [&](int bx, int by, int i, int *count) {
+      for (int ix = bx; ix < std::min(bx + bw, tile.x1); ++ix) {
+        for (int iy = by; iy < std::min(by + bh, tile.y1); ++iy) {
+          if (active && !active[iy*target->width + ix]) {
+            continue;
+          }
+          // the sub pixels share the sample sequence of their pixel
+          uint32_t const pixel = uint32_t(iy*target->width + ix);
+          for (int sub = 0; sub < n*n; ++sub) {
+            uint32_t const index = (uint32_t(sub) << SUBPIXEL_SAMPLE_BITS) + uint32_t(first + i);
+            sampler.start(pixel, index);
+            real_t const u = (real_t(sub % n) + sampler.next()) / real_t(n);
+            real_t const v = (real_t(sub / n) + sampler.next()) / real_t(n);
+            real_t dx, dy;
+            filter.sample(u, v, &dx, &dy);
+            w->xs[*count] = real_t(ix) + dx;
+            w->ys[*count] = real_t(iy) + dy;
+            w->pixel[*count] = (iy - tile.y0)*tw + (ix - tile.x0);
+            w->index[*count] = index;
+            ++*count;
+          }
+        }
+      }
+    };
+
+    if (opt.wavefront) {
+      for (int i = 0; i < opt.samples; ++i) {
+        int count = 0;
+        for (int bx = tile.x0; bx < tile.x1; bx += bw) {
+          for (int by = tile.y0; by < tile.y1; by += bh) {
+            generate(bx, by, i, &count);
+          }
+        }
+        if (count == 0) {
+          break;
+        }
+        tracePrimary(scene, view, w->xs.data(), w->ys.data(), count, opt.packet, w->primary.data(), &w->stats);
+        traceWavefront(scene, opt, tile, target->width, count, w);
+        for (int p = 0; p < count; ++p) {
+          w->tile[w->pixel[p]] += w->wave.color[p] * weight;
+        }
+      }
+      return;
+    }
+
+    for (int bx = tile.x0; bx < tile.x1; bx += bw) {
+      for (int by = tile.y0; by < tile.y1; by += bh) {
+        for (int i = 0; i < opt.samples; ++i) {
+          int count = 0;
+          generate(bx, by, i, &count);
+          if (count == 0) {
+            break;
+          }
+          tracePrimary(scene, view, w->xs.data(), w->ys.data(), count, opt.packet, w->primary.data(), &w->stats);
+
+          for (int p = 0; p < count; ++p) {
+            primary_t const& primary = w->primary[p];
+            if (!primary.found) {
+              continue;
             }
+            intersection_t intersection;
+            scene.surface(primary.ray, primary.hit, &intersection);
+            int const local = w->pixel[p];
+            sampler.start(uint32_t((tile.y0 + local / tw)*target->width + tile.x0 + local % tw), w->index[p]);
+            ++w->paths.paths;
+            w->tile[local] += radiance(primary.ray, primary.hit, intersection, scene, opt, sampler, &w->paths) * weight;
           }
         }
-        target->pixels[iy*target->width + ix] += pixelColor * real_t(0.25);
       }
     }
-    fprintf(stdout, "rendering ... %.2f%%    \r", float(ix*100) / float(target->width));
+  }, &stats, &paths);
+  if (report) {
+    fprintf(stdout, "done.                     \n");
+    reportPrimary(stats, opt.packet);
+    reportPaths(paths);
   }
-  fprintf(stdout, "done.                     \n");
 }
 
+void renderSamples(bitmap_t *target, Scene const& scene, option_t const& opt, int first,
+                   uint8_t const *active) {
+  renderRange(target, scene, opt, first, active, false);
+}
+
+/// properly renders the scene
+void render(bitmap_t *target, Scene const& scene, option_t const& opt) {
+  renderRange(target, scene, opt, 0, nullptr, true);
+}
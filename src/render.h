@@ -1,4 +1,7 @@
+#pragma once
 #include "scene.h"
+#include "sampler.h"
+#include "filter.h"
 #include "math.h"
 
 struct bitmap_t {
@@ -8,12 +11,38 @@ struct bitmap_t {
 };
 
 struct option_t {
-  int     depth;
-  int     samples;
+  int            depth;
+  int            rr_depth; // bounces before russian roulette may end a path
+  int            samples;  // per sub pixel
+  int            subpixels; // sub pixel strata per axis, each gets its own samples
+  int            packet;  // primary rays traced together: 1 (no packets), 4, 8 or 16
+  int            threads; // render threads, 0 for one per hardware thread
+  int            tile;    // edge length of the square tiles handed to the threads
+  bool           wavefront; // trace a sample of a tile bounce by bounce, not path by path
+  bool           reorder;   // wavefront: sort rays by direction and origin before tracing
+  sampler_type_t sampler;
+  filter_type_t  filter;
+  uint32_t       seed;    // sample sequences are a function of seed, pixel and sample
+};
+
+/// difference of two images in 8 bit ppm units
+struct image_diff_t {
+  double rmse;       // root mean square over all channels
+  double psnr;       // db, infinite for identical images
+  int    max_error;  // largest channel difference
+  int    pixels;     // pixels with any channel different
 };
 
 bitmap_t createRenderTarget(int width, int height);
 void     deleteRenderTarget(bitmap_t *bm);
 bool     saveRenderTarget(char const* filename, bitmap_t const& bm);
+/// compares bm, as saveRenderTarget() would write it, to a saved ppm
+bool     compareRenderTarget(char const* reference, bitmap_t const& bm, image_diff_t *diff);
 void     renderLowQuality(bitmap_t *target, Scene const& scene, option_t const& opt);
 void     render(bitmap_t *target, Scene const& scene, option_t const& opt);
+/// mean of samples [first, first + opt.samples) of every pixel, without any
+/// output. sample sequences do not depend on how they are split up, so passes
+/// add up to the image of a single render() of all their samples. if active
+/// is given, pixels where it is 0 are skipped and left black.
+void     renderSamples(bitmap_t *target, Scene const& scene, option_t const& opt, int first,
+                       uint8_t const *active = nullptr);
@@ -0,0 +1,123 @@
+#include "sampler.h"
+#include <string.h>
+
+bool parseSamplerType(char const *name, sampler_type_t *type) {
+  static struct {
+    char const    *name;
+    sampler_type_t type;
+  } const types[] = {
+    {"random", SAMPLER_RANDOM},
+    {"halton", SAMPLER_HALTON},
+    {"sobol", SAMPLER_SOBOL},
+    {"owen", SAMPLER_OWEN},
+  };
+  for (auto const &t : types) {
+    if (!strcmp(name, t.name)) {
+      *type = t.type;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// reference: Jarzynski and Olano, Hash Functions for GPU Rendering
+static uint32_t pcgHash(uint32_t v) {
+  uint32_t const state = v * 747796405u + 2891336453u;
+  uint32_t const word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+static uint32_t hashCombine(uint32_t seed, uint32_t v) {
+  return pcgHash(seed ^ pcgHash(v));
+}
+
+/// top 24 bits, so the result stays below 1 in float as well
+static real_t toUnit(uint32_t bits) {
+  return real_t(bits >> 8) * real_t(1.0 / 16777216.0);
+}
+
+static uint32_t reverseBits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+/// reference: Burley, Practical Hash-based Owen Scrambling. bits only depend
+/// on lower bits, so on reversed digits this is a nested uniform scramble.
+static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+static uint32_t owenScramble(uint32_t x, uint32_t seed) {
+  return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+/// first two sobol dimensions: van der corput and the x + 1 polynomial,
+/// together a (0, 2) sequence, as 0.32 fixed point
+static uint32_t sobol(uint32_t index, int dimension) {
+  if (dimension == 0) {
+    return reverseBits(index);
+  }
+  uint32_t result = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1) {
+      result ^= v;
+    }
+  }
+  return result;
+}
+
+static const int HALTON_DIMENSIONS = 32;
+static const uint32_t HALTON_PRIMES[HALTON_DIMENSIONS] = {
+  2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+  59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+
+static real_t radicalInverse(uint32_t index, uint32_t base) {
+  real_t const inv_base = real_t(1) / real_t(base);
+  real_t       inv = inv_base;
+  real_t       result = real_t(0);
+  for (; index; index /= base, inv *= inv_base) {
+    result += real_t(index % base) * inv;
+  }
+  return result;
+}
+
+void Sampler::start(uint32_t pixel, uint32_t index) {
+  pixel_seed = hashCombine(seed, pixel);
+  this->index = index;
+  dimension = 0;
+}
+
+real_t Sampler::next() {
+  uint32_t const d = dimension++;
+  uint32_t const dim_seed = hashCombine(pixel_seed, d);
+  switch (type) {
+  case SAMPLER_HALTON:
+    if (d < uint32_t(HALTON_DIMENSIONS)) {
+      // cranley-patterson rotation decorrelates neighbouring pixels
+      real_t const x = radicalInverse(index, HALTON_PRIMES[d]) + toUnit(dim_seed);
+      real_t const r = x - std::floor(x);
+      return r < real_t(1) ? r : real_t(0);
+    }
+    break;
+  case SAMPLER_SOBOL:
+  case SAMPLER_OWEN: {
+    uint32_t const pair_seed = hashCombine(pixel_seed, ~(d / 2));
+    uint32_t const shuffled = owenScramble(index, pair_seed);
+    uint32_t const x = sobol(shuffled, int(d % 2));
+    return toUnit(type == SAMPLER_OWEN ? owenScramble(x, dim_seed) : x ^ dim_seed);
+  }
+  default:
+    break;
+  }
+  return toUnit(hashCombine(dim_seed, index));
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "math.h"
+#include <stdint.h>
+
+enum sampler_type_t {
+  SAMPLER_RANDOM, // independent, counter based pcg hash
+  SAMPLER_HALTON, // halton, rotated per pixel
+  SAMPLER_SOBOL,  // 2d sobol pairs, digits xor scrambled per pixel
+  SAMPLER_OWEN    // 2d sobol pairs, owen scrambled per pixel
+};
+
+/// parses random, halton, sobol or owen, false for anything else
+bool parseSamplerType(char const *name, sampler_type_t *type);
+
+/// sample sequence of a pixel. dimension d of sample i is a pure function of
+/// (seed, pixel, i, d), so renders are reproducible for any thread count and
+/// tile order, and a sampler can be created wherever one is needed.
+/// the qmc samplers draw consecutive dimensions in pairs from 2d sobol or
+/// halton points; each pair gets its own shuffle of the sample indices, so
+/// pairs stay well stratified without being correlated with each other.
+class Sampler {
+public:
+  Sampler(sampler_type_t type, uint32_t seed) : type(type), seed(seed) {}
+
+  /// restarts at dimension 0 of sample index of pixel
+  void start(uint32_t pixel, uint32_t index);
+  /// next dimension of the current sample, in [0, 1)
+  real_t next();
+  /// continues the current sample at dimension d, so that a bounce always
+  /// draws the same dimensions no matter how many earlier bounces used
+  void seek(uint32_t d) { dimension = d; }
+
+private:
+  sampler_type_t type;
+  uint32_t       seed;
+  uint32_t       pixel_seed = 0;
+  uint32_t       index = 0;
+  uint32_t       dimension = 0;
+};
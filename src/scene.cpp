@@ -4,6 +4,34 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <algorithm>
+
+/// sah cost of a refit bvh over that of a fresh build, beyond which
+/// Scene::update() builds it again
+static const real_t BVH_MAX_REFIT_COST = real_t(1.3);
+
+bool parseAccelType(char const *name, accel_type_t *type) {
+  static struct {
+    char const  *name;
+    accel_type_t type;
+  } const types[] = {
+    {"bvh", ACCEL_BVH},
+    {"bvh4", ACCEL_BVH4},
+    {"bvh8", ACCEL_BVH8},
+    {"bvh4q", ACCEL_BVH4Q},
+    {"bvh8q", ACCEL_BVH8Q},
+    {"lazy", ACCEL_LAZY},
+    {"grid", ACCEL_GRID},
+    {"none", ACCEL_NONE},
+  };
+  for (auto const &t : types) {
+    if (!strcmp(name, t.name)) {
+      *type = t.type;
+      return true;
+    }
+  }
+  return false;
+}
 
 static vec3_t _vec3Attr(pugi::xml_node node, char const* name) {
   float v[3];
@@ -31,7 +59,7 @@ static Geometry* _createPlane(pugi::xml_node node) {
   assert(!strncmp( node.attribute("type").value(), "plane", 6 ));
   Plane *p = new Plane;
   p->center = _vec3Attr(node, "center");
-  p->normal = _vec3Attr(node, "normal");
+  p->normal = normalize(_vec3Attr(node, "normal"));
   return p;
 }
 
@@ -39,7 +67,7 @@ static Geometry* _createDisk(pugi::xml_node node) {
   assert(!strncmp( node.attribute("type").value(), "disk", 5 ));
   Disk *d = new Disk;
   d->center = _vec3Attr(node, "center");
-  d->normal = _vec3Attr(node, "normal");
+  d->normal = normalize(_vec3Attr(node, "normal"));
   d->radius = node.attribute("radius").as_float(1.0f);
   return d;
 }
@@ -65,7 +93,8 @@ static std::unordered_map<std::string, Geometry* (*)(pugi::xml_node)> getRegistr
   return reg;
 }
 
-bool Scene::read(std::string const& filename) {
+bool Scene::read(std::string const& filename, accel_type_t accel,
+                 bvh_build_t quality, int threads) {
   pugi::xml_document xml;
   if (!xml.load_file(filename.c_str())) {
     return false;
@@ -74,6 +103,10 @@ bool Scene::read(std::string const& filename) {
     delete g;
   }
   geometry_list.clear();
+  unbounded_list.clear();
+  bounded_list.clear();
+  emitter_list.clear();
+  emitter_cdf.clear();
   material_list.clear();
 
   pugi::xml_node root = xml.child("scene");
@@ -98,7 +131,8 @@ bool Scene::read(std::string const& filename) {
       delete g;
       continue;
     }
-    g->material = material_list[geo.attribute("material").value()];
+    g->material = &material_list[geo.attribute("material").value()];
+    g->id = int(geometry_list.size());
     geometry_list.push_back(g);
   }
 
@@ -113,7 +147,168 @@ bool Scene::read(std::string const& filename) {
   camera.fov = cam.attribute("fov").as_float(0.8f);
   camera.near = cam.attribute("near").as_float(0.1f);
   camera.far = cam.attribute("far").as_float(1000.0f);
+
+  aabb_t bounds;
+  for (Geometry* g:geometry_list) {
+    if (!g->bounds(&bounds)) {
+      unbounded_list.push_back(g);
+    } else {
+      bounded_list.push_back(g);
+    }
+  }
+  for (Geometry* g:geometry_list) {
+    if (isSampledEmitter(g->id)) {
+      emitter_list.push_back(g);
+      emitter_cdf.push_back((emitter_cdf.empty() ? real_t(0) : emitter_cdf.back()) + g->area());
+    }
+  }
+  unbounded.build(std::vector<Geometry const*>(unbounded_list.begin(), unbounded_list.end()));
+  this->accel = accel;
+  this->quality = quality;
+  this->threads = threads;
+  buildAccel();
   return true;
 }
 
+void Scene::buildAccel() {
+  switch (accel) {
+  case ACCEL_BVH4:
+  case ACCEL_BVH8:
+  case ACCEL_BVH4Q:
+  case ACCEL_BVH8Q: {
+    BVH binary;
+    binary.build(geometry_list, quality, threads);
+    if (accel == ACCEL_BVH4 || accel == ACCEL_BVH4Q) {
+      bvh4.build(std::move(binary));
+    } else {
+      bvh8.build(std::move(binary));
+    }
+    if (accel == ACCEL_BVH4Q) {
+      bvh4q.build(std::move(bvh4));
+    } else if (accel == ACCEL_BVH8Q) {
+      bvh8q.build(std::move(bvh8));
+    }
+    break;
+  }
+  case ACCEL_LAZY:
+    lazy.build(geometry_list);
+    break;
+  case ACCEL_GRID:
+    grid.build(geometry_list);
+    break;
+  case ACCEL_NONE:
+    bounded.build(std::vector<Geometry const*>(bounded_list.begin(), bounded_list.end()));
+    break;
+  default:
+    bvh.build(geometry_list, quality, threads);
+    break;
+  }
+}
+
+void Scene::transform(int id, rigid_t const& motion) {
+  geometry_list[id]->transform(motion);
+}
+
+bool Scene::update() {
+  unbounded.build(std::vector<Geometry const*>(unbounded_list.begin(), unbounded_list.end()));
+  if (accel == ACCEL_BVH && bvh.refit(threads) <= BVH_MAX_REFIT_COST) {
+    return true;
+  }
+  buildAccel();
+  return false;
+}
+
+/// closest hit among the bounded geometries, hit is untouched on a miss
+bool Scene::intersectBounded(ray_t const& ray, real_t tmax, hit_t *hit, long long *visits) const {
+  switch (accel) {
+  case ACCEL_BVH4:
+    return bvh4.intersect(ray, tmax, hit, visits);
+  case ACCEL_BVH8:
+    return bvh8.intersect(ray, tmax, hit, visits);
+  case ACCEL_BVH4Q:
+    return bvh4q.intersect(ray, tmax, hit, visits);
+  case ACCEL_BVH8Q:
+    return bvh8q.intersect(ray, tmax, hit, visits);
+  case ACCEL_LAZY:
+    return lazy.intersect(ray, tmax, hit, visits);
+  case ACCEL_GRID:
+    return grid.intersect(ray, tmax, hit, visits);
+  case ACCEL_NONE:
+    return bounded.intersect(bounded.all(), ray, tmax, hit);
+  default:
+    return bvh.intersect(ray, tmax, hit, visits);
+  }
+}
+
+bool Scene::intersect(ray_t const& ray, real_t tmax, hit_t *hit, long long *visits) const {
+  // bounded geometry goes first so it wins ties against coplanar planes, like
+  // the disks laid onto the walls of test/room.xml
+  bool found = intersectBounded(ray, tmax, hit, visits);
+  if (found) {
+    tmax = hit->t;
+  }
+  return unbounded.intersect(unbounded.all(), ray, tmax, hit) || found;
+}
+
+void Scene::intersect(ray_packet_t const& packet, hit_packet_t *hits, long long *visits) const {
+  // same order as the single ray version, so ties resolve the same way
+  if (accel == ACCEL_BVH) {
+    bvh.intersect(packet, hits, visits);
+  } else {
+    for (int i = 0; i < packet.size; ++i) {
+      ray_t const ray = { vec3_t(packet.ox[i], packet.oy[i], packet.oz[i]),
+                          vec3_t(packet.dx[i], packet.dy[i], packet.dz[i]) };
+      hit_t hit;
+      if (intersectBounded(ray, hits->t[i], &hit, visits)) {
+        hits->t[i] = hit.t;
+        hits->id[i] = hit.id;
+      }
+    }
+  }
+  for (Geometry* g : unbounded_list) {
+    g->intersect(packet, hits);
+  }
+}
+
+bool Scene::occluded(ray_t const& ray, real_t tmin, real_t tmax) const {
+  if (unbounded.occluded(unbounded.all(), ray, tmin, tmax)) {
+    return true;
+  }
+  switch (accel) {
+  case ACCEL_BVH4:
+    return bvh4.occluded(ray, tmin, tmax);
+  case ACCEL_BVH8:
+    return bvh8.occluded(ray, tmin, tmax);
+  case ACCEL_BVH4Q:
+    return bvh4q.occluded(ray, tmin, tmax);
+  case ACCEL_BVH8Q:
+    return bvh8q.occluded(ray, tmin, tmax);
+  case ACCEL_LAZY:
+    return lazy.occluded(ray, tmin, tmax);
+  case ACCEL_GRID:
+    return grid.occluded(ray, tmin, tmax);
+  case ACCEL_NONE:
+    return bounded.occluded(bounded.all(), ray, tmin, tmax);
+  default:
+    return bvh.occluded(ray, tmin, tmax);
+  }
+}
 
+void Scene::surface(ray_t const& ray, hit_t const& hit, intersection_t *intersection) const {
+  geometry_list[hit.id]->surface(ray, hit.t, intersection);
+}
+
+bool Scene::sampleEmitter(real_t u, real_t v, real_t w, emitter_sample_t *sample) const {
+  if (emitter_list.empty()) {
+    return false;
+  }
+  real_t const total = emitter_cdf.back();
+  size_t const i = std::min(size_t(std::upper_bound(emitter_cdf.begin(), emitter_cdf.end(), w * total) - emitter_cdf.begin()),
+                            emitter_list.size() - 1);
+  Geometry const* g = emitter_list[i];
+  g->sample(u, v, &sample->position, &sample->normal);
+  sample->emission = g->material->color;
+  sample->pdf = real_t(1) / total;
+  sample->id = g->id;
+  return true;
+}
@@ -1,10 +1,39 @@
 #pragma once
+#include "bvh.h"
+#include "grid.h"
+#include "wide_bvh.h"
+#include "lazy_bvh.h"
 #include "geometry.h"
 #include "material.h"
 #include <vector>
 #include <string>
 #include <unordered_map>
 
+/// structure the bounded geometries are found with, planes are always
+/// tested one by one
+enum accel_type_t {
+  ACCEL_BVH,  // binned sah bvh
+  ACCEL_BVH4, // the same collapsed to 4 children per node
+  ACCEL_BVH8, // and to 8
+  ACCEL_BVH4Q, // bvh4 with 8 bit quantized child boxes
+  ACCEL_BVH8Q, // bvh8 with 8 bit quantized child boxes
+  ACCEL_LAZY, // binned sah bvh split as rays arrive
+  ACCEL_GRID, // uniform grid
+  ACCEL_NONE  // every primitive for every ray
+};
+
+/// parses bvh, bvh4, bvh8, bvh4q, bvh8q, lazy, grid or none, false for anything else
+bool parseAccelType(char const *name, accel_type_t *type);
+
+/// point on an emitter, see Scene::sampleEmitter()
+struct emitter_sample_t {
+  vec3_t position;
+  vec3_t normal;
+  vec3_t emission;
+  real_t pdf; // per unit area
+  int    id;  // index into Scene::geometry_list
+};
+
 struct camera_t {
   vec3_t position;
   vec3_t direction;
@@ -19,6 +48,22 @@ public:
   Scene() = default;
 
   std::vector<Geometry*>   geometry_list;
+  std::vector<Geometry*>   unbounded_list; // planes, tested for every ray
+  std::vector<Geometry*>   bounded_list;   // everything else
+  GeometrySoA              unbounded;      // unbounded_list compiled
+  accel_type_t             accel = ACCEL_BVH;
+  bvh_build_t              quality = BVH_BUILD_SAH;
+  int                      threads = 0;    // for building, 0 for all hardware threads
+  BVH                      bvh;            // everything else, with ACCEL_BVH
+  WideBVH<4>               bvh4;           // the same with ACCEL_BVH4
+  WideBVH<8>               bvh8;           // the same with ACCEL_BVH8
+  QuantizedBVH<4>          bvh4q;          // the same with ACCEL_BVH4Q
+  QuantizedBVH<8>          bvh8q;          // the same with ACCEL_BVH8Q
+  LazyBVH                  lazy;           // the same with ACCEL_LAZY
+  Grid                     grid;           // the same with ACCEL_GRID
+  GeometrySoA              bounded;        // the same with ACCEL_NONE
+  std::vector<Geometry*>   emitter_list;   // bounded emitters, sampled by area
+  std::vector<real_t>      emitter_cdf;    // running sum of their areas
   std::unordered_map<std::string, material_t> material_list;
   camera_t camera;
   ~Scene() {
@@ -27,6 +72,45 @@ public:
     }
   }
 
-  bool read(std::string const& fliename);
+  /// loads the scene and builds the acceleration structure of type accel,
+  /// a bvh of the given quality on threads build threads
+  bool read(std::string const& fliename, accel_type_t accel = ACCEL_BVH,
+            bvh_build_t quality = BVH_BUILD_SAH, int threads = 0);
+  /// moves geometry id, for animation. the acceleration structures only
+  /// follow on update()
+  void transform(int id, rigid_t const& motion);
+  /// brings the acceleration structures up to date after transform(). the
+  /// binary bvh is refit, and only built again once refitting made it
+  /// noticeably worse; the others are always built again. true if refit.
+  bool update();
+  /// finds the closest hit closer than tmax. adds the number of bvh node boxes
+  /// tested, or grid cells visited, to visits if given.
+  bool intersect(ray_t const& ray, real_t tmax, hit_t *hit, long long *visits = nullptr) const;
+  /// closest hits of a packet of coherent rays, tmax is taken from hits->t.
+  /// adds the number of bvh node boxes tested, once per packet, to visits.
+  /// only the binary bvh traces packets together, the others take ray by ray.
+  void intersect(ray_packet_t const& packet, hit_packet_t *hits, long long *visits = nullptr) const;
+  /// whether anything is hit in [tmin, tmax], for visibility tests
+  bool occluded(ray_t const& ray, real_t tmin, real_t tmax) const;
+  /// reconstructs the surface of a hit found by intersect()
+  void surface(ray_t const& ray, hit_t const& hit, intersection_t *intersection) const;
+  /// closest hit among the bounded geometries, see intersect()
+  bool intersectBounded(ray_t const& ray, real_t tmax, hit_t *hit, long long *visits = nullptr) const;
+  /// picks an emitter with probability proportional to its area with w and a
+  /// point on it with u, v. false if there is nothing to sample.
+  bool sampleEmitter(real_t u, real_t v, real_t w, emitter_sample_t *sample) const;
+  /// whether sampleEmitter() can pick the geometry
+  bool isSampledEmitter(int id) const {
+    return geometry_list[id]->material->emit && geometry_list[id]->area() > real_t(0);
+  }
+  /// density of sampleEmitter() per unit area on the geometry, zero if it is
+  /// never picked
+  real_t emitterPdf(int id) const {
+    return isSampledEmitter(id) ? real_t(1) / emitter_cdf.back() : real_t(0);
+  }
+
+private:
+  /// builds the structure of type accel over bounded_list
+  void buildAccel();
 };
 
@@ -0,0 +1,95 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+int hardwareThreads() {
+  return std::max(1, int(std::thread::hardware_concurrency()));
+}
+
+/// items of one worker. the owner pops from the front, thieves from the back,
+/// so both ends stay spatially coherent.
+struct work_queue_t {
+  std::mutex      lock;
+  std::deque<int> items;
+};
+
+static bool popFront(work_queue_t *queue, int *item) {
+  std::lock_guard<std::mutex> guard(queue->lock);
+  if (queue->items.empty()) {
+    return false;
+  }
+  *item = queue->items.front();
+  queue->items.pop_front();
+  return true;
+}
+
+static bool popBack(work_queue_t *queue, int *item) {
+  std::lock_guard<std::mutex> guard(queue->lock);
+  if (queue->items.empty()) {
+    return false;
+  }
+  *item = queue->items.back();
+  queue->items.pop_back();
+  return true;
+}
+
+/// takes an item from the queue with the most work left, false once all are
+/// empty. items are never added, so an empty round means everything is taken.
+static bool steal(std::vector<std::unique_ptr<work_queue_t>> &queues,
+                  int *item) {
+  for (;;) {
+    work_queue_t *victim = nullptr;
+    size_t        most = 0;
+    for (auto &queue : queues) {
+      std::lock_guard<std::mutex> guard(queue->lock);
+      if (queue->items.size() > most) {
+        most = queue->items.size();
+        victim = queue.get();
+      }
+    }
+    if (!victim) {
+      return false;
+    }
+    if (popBack(victim, item)) {
+      return true;
+    }
+  }
+}
+
+void parallelFor(int count, int threads,
+                 std::function<void(int item, int thread)> const &task) {
+  threads = std::max(1, std::min(threads, count));
+  if (threads == 1) {
+    for (int i = 0; i < count; ++i) {
+      task(i, 0);
+    }
+    return;
+  }
+
+  std::vector<std::unique_ptr<work_queue_t>> queues;
+  for (int t = 0; t < threads; ++t) {
+    queues.emplace_back(new work_queue_t);
+    for (int i = count * t / threads; i < count * (t + 1) / threads; ++i) {
+      queues[t]->items.push_back(i);
+    }
+  }
+
+  auto worker = [&](int thread) {
+    int item;
+    while (popFront(queues[thread].get(), &item) || steal(queues, &item)) {
+      task(item, thread);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int t = 1; t < threads; ++t) {
+    pool.emplace_back(worker, t);
+  }
+  worker(0);
+  for (std::thread &t : pool) {
+    t.join();
+  }
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <functional>
+
+/// number of threads the machine runs concurrently, at least 1
+int hardwareThreads();
+
+/// runs task(item, thread) for every item in [0, count) on threads workers.
+/// each worker starts on its own contiguous share of the items and, once that
+/// runs dry, steals single items from the back of the busiest other share,
+/// so a few expensive items do not leave the other workers idle.
+void parallelFor(int count, int threads,
+                 std::function<void(int item, int thread)> const &task);
@@ -0,0 +1,252 @@
+#pragma once
+#include "math.h"
+#include <string.h>
+
+// lane count follows the instruction set the compiler targets and the width
+// of real_t, define SIMPLE_PT_NO_SIMD to get the plain scalar fallback.
+#if defined(SIMPLE_PT_NO_SIMD)
+#define SIMD_WIDTH 1
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE
+#else
+#define SIMD_WIDTH 1
+#endif
+
+#if defined(SIMD_AVX) && defined(SIMPLE_PT_REAL_FLOAT)
+#define SIMD_WIDTH 8
+#elif defined(SIMD_AVX) || (defined(SIMD_SSE) && defined(SIMPLE_PT_REAL_FLOAT))
+#define SIMD_WIDTH 4
+#elif defined(SIMD_SSE)
+#define SIMD_WIDTH 2
+#endif
+
+/// SIMD_WIDTH reals processed in lock step. every operation mirrors its
+/// scalar counterpart exactly, including std::min/std::max NaN handling, so
+/// kernels written with vreal_t give bit identical results for any width,
+/// as long as the compiler does not fuse the scalar a*b+c into an fma
+/// (gcc/clang -ffp-contract=off, msvc /fp:precise).
+struct vreal_t {
+#if defined(SIMD_AVX) && defined(SIMPLE_PT_REAL_FLOAT)
+  __m256 v;
+#elif defined(SIMD_AVX)
+  __m256d v;
+#elif defined(SIMD_SSE) && defined(SIMPLE_PT_REAL_FLOAT)
+  __m128 v;
+#elif defined(SIMD_SSE)
+  __m128d v;
+#else
+  real_t v;
+#endif
+};
+
+/// per lane comparison result
+struct vmask_t {
+#if defined(SIMD_AVX) && defined(SIMPLE_PT_REAL_FLOAT)
+  __m256 v;
+#elif defined(SIMD_AVX)
+  __m256d v;
+#elif defined(SIMD_SSE) && defined(SIMPLE_PT_REAL_FLOAT)
+  __m128 v;
+#elif defined(SIMD_SSE)
+  __m128d v;
+#else
+  bool v;
+#endif
+};
+
+#if defined(SIMD_AVX) && defined(SIMPLE_PT_REAL_FLOAT)
+
+inline vreal_t vset(real_t r) { return vreal_t{_mm256_set1_ps(r)}; }
+inline vreal_t vload(real_t const *p) { return vreal_t{_mm256_loadu_ps(p)}; }
+/// SIMD_WIDTH bytes at p, zero extended
+inline vreal_t vload(uint8_t const *p) {
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const words = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(p)), zero);
+  __m256i const ints = _mm256_insertf128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(words, zero)),
+                                               _mm_unpackhi_epi16(words, zero), 1);
+  return vreal_t{_mm256_cvtepi32_ps(ints)};
+}
+inline void vstore(real_t *p, vreal_t a) { _mm256_storeu_ps(p, a.v); }
+inline vreal_t operator+(vreal_t a, vreal_t b) { return vreal_t{_mm256_add_ps(a.v, b.v)}; }
+inline vreal_t operator-(vreal_t a, vreal_t b) { return vreal_t{_mm256_sub_ps(a.v, b.v)}; }
+inline vreal_t operator*(vreal_t a, vreal_t b) { return vreal_t{_mm256_mul_ps(a.v, b.v)}; }
+inline vreal_t operator/(vreal_t a, vreal_t b) { return vreal_t{_mm256_div_ps(a.v, b.v)}; }
+inline vreal_t operator-(vreal_t a) { return vreal_t{_mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f))}; }
+inline vreal_t vsqrt(vreal_t a) { return vreal_t{_mm256_sqrt_ps(a.v)}; }
+inline vreal_t vabs(vreal_t a) { return vreal_t{_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)}; }
+// argument order matches std::min/std::max when one side is NaN
+inline vreal_t vmin(vreal_t a, vreal_t b) { return vreal_t{_mm256_min_ps(b.v, a.v)}; }
+inline vreal_t vmax(vreal_t a, vreal_t b) { return vreal_t{_mm256_max_ps(b.v, a.v)}; }
+inline vmask_t operator<(vreal_t a, vreal_t b) { return vmask_t{_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+inline vmask_t operator<=(vreal_t a, vreal_t b) { return vmask_t{_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+inline vmask_t operator>(vreal_t a, vreal_t b) { return vmask_t{_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)}; }
+inline vmask_t operator>=(vreal_t a, vreal_t b) { return vmask_t{_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+inline vmask_t operator&(vmask_t a, vmask_t b) { return vmask_t{_mm256_and_ps(a.v, b.v)}; }
+inline vmask_t operator|(vmask_t a, vmask_t b) { return vmask_t{_mm256_or_ps(a.v, b.v)}; }
+/// a and not b
+inline vmask_t andnot(vmask_t a, vmask_t b) { return vmask_t{_mm256_andnot_ps(b.v, a.v)}; }
+inline vmask_t vnone() { return vmask_t{_mm256_setzero_ps()}; }
+inline vmask_t vall() { return vmask_t{_mm256_castsi256_ps(_mm256_set1_epi32(-1))}; }
+/// lanes [0, n) set
+inline vmask_t vlanes(int n) { return vmask_t{_mm256_cmp_ps(_mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_ps(float(n)), _CMP_LT_OQ)}; }
+inline vreal_t select(vmask_t m, vreal_t a, vreal_t b) { return vreal_t{_mm256_blendv_ps(b.v, a.v, m.v)}; }
+/// bit i set if lane i is set
+inline int movemask(vmask_t m) { return _mm256_movemask_ps(m.v); }
+
+#elif defined(SIMD_AVX)
+
+inline vreal_t vset(real_t r) { return vreal_t{_mm256_set1_pd(r)}; }
+inline vreal_t vload(real_t const *p) { return vreal_t{_mm256_loadu_pd(p)}; }
+/// SIMD_WIDTH bytes at p, zero extended
+inline vreal_t vload(uint8_t const *p) {
+  int32_t bytes;
+  memcpy(&bytes, p, sizeof(bytes));
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+  return vreal_t{_mm256_cvtepi32_pd(_mm_unpacklo_epi16(words, zero))};
+}
+inline void vstore(real_t *p, vreal_t a) { _mm256_storeu_pd(p, a.v); }
+inline vreal_t operator+(vreal_t a, vreal_t b) { return vreal_t{_mm256_add_pd(a.v, b.v)}; }
+inline vreal_t operator-(vreal_t a, vreal_t b) { return vreal_t{_mm256_sub_pd(a.v, b.v)}; }
+inline vreal_t operator*(vreal_t a, vreal_t b) { return vreal_t{_mm256_mul_pd(a.v, b.v)}; }
+inline vreal_t operator/(vreal_t a, vreal_t b) { return vreal_t{_mm256_div_pd(a.v, b.v)}; }
+inline vreal_t operator-(vreal_t a) { return vreal_t{_mm256_xor_pd(a.v, _mm256_set1_pd(-0.0))}; }
+inline vreal_t vsqrt(vreal_t a) { return vreal_t{_mm256_sqrt_pd(a.v)}; }
+inline vreal_t vabs(vreal_t a) { return vreal_t{_mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v)}; }
+// argument order matches std::min/std::max when one side is NaN
+inline vreal_t vmin(vreal_t a, vreal_t b) { return vreal_t{_mm256_min_pd(b.v, a.v)}; }
+inline vreal_t vmax(vreal_t a, vreal_t b) { return vreal_t{_mm256_max_pd(b.v, a.v)}; }
+inline vmask_t operator<(vreal_t a, vreal_t b) { return vmask_t{_mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ)}; }
+inline vmask_t operator<=(vreal_t a, vreal_t b) { return vmask_t{_mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ)}; }
+inline vmask_t operator>(vreal_t a, vreal_t b) { return vmask_t{_mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ)}; }
+inline vmask_t operator>=(vreal_t a, vreal_t b) { return vmask_t{_mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ)}; }
+inline vmask_t operator&(vmask_t a, vmask_t b) { return vmask_t{_mm256_and_pd(a.v, b.v)}; }
+inline vmask_t operator|(vmask_t a, vmask_t b) { return vmask_t{_mm256_or_pd(a.v, b.v)}; }
+/// a and not b
+inline vmask_t andnot(vmask_t a, vmask_t b) { return vmask_t{_mm256_andnot_pd(b.v, a.v)}; }
+inline vmask_t vnone() { return vmask_t{_mm256_setzero_pd()}; }
+inline vmask_t vall() { return vmask_t{_mm256_castsi256_pd(_mm256_set1_epi64x(-1))}; }
+/// lanes [0, n) set
+inline vmask_t vlanes(int n) { return vmask_t{_mm256_cmp_pd(_mm256_set_pd(3, 2, 1, 0), _mm256_set1_pd(n), _CMP_LT_OQ)}; }
+inline vreal_t select(vmask_t m, vreal_t a, vreal_t b) { return vreal_t{_mm256_blendv_pd(b.v, a.v, m.v)}; }
+/// bit i set if lane i is set
+inline int movemask(vmask_t m) { return _mm256_movemask_pd(m.v); }
+
+#elif defined(SIMD_SSE) && defined(SIMPLE_PT_REAL_FLOAT)
+
+inline vreal_t vset(real_t r) { return vreal_t{_mm_set1_ps(r)}; }
+inline vreal_t vload(real_t const *p) { return vreal_t{_mm_loadu_ps(p)}; }
+/// SIMD_WIDTH bytes at p, zero extended
+inline vreal_t vload(uint8_t const *p) {
+  int32_t bytes;
+  memcpy(&bytes, p, sizeof(bytes));
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+  return vreal_t{_mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero))};
+}
+inline void vstore(real_t *p, vreal_t a) { _mm_storeu_ps(p, a.v); }
+inline vreal_t operator+(vreal_t a, vreal_t b) { return vreal_t{_mm_add_ps(a.v, b.v)}; }
+inline vreal_t operator-(vreal_t a, vreal_t b) { return vreal_t{_mm_sub_ps(a.v, b.v)}; }
+inline vreal_t operator*(vreal_t a, vreal_t b) { return vreal_t{_mm_mul_ps(a.v, b.v)}; }
+inline vreal_t operator/(vreal_t a, vreal_t b) { return vreal_t{_mm_div_ps(a.v, b.v)}; }
+inline vreal_t operator-(vreal_t a) { return vreal_t{_mm_xor_ps(a.v, _mm_set1_ps(-0.0f))}; }
+inline vreal_t vsqrt(vreal_t a) { return vreal_t{_mm_sqrt_ps(a.v)}; }
+inline vreal_t vabs(vreal_t a) { return vreal_t{_mm_andnot_ps(_mm_set1_ps(-0.0f), a.v)}; }
+// argument order matches std::min/std::max when one side is NaN
+inline vreal_t vmin(vreal_t a, vreal_t b) { return vreal_t{_mm_min_ps(b.v, a.v)}; }
+inline vreal_t vmax(vreal_t a, vreal_t b) { return vreal_t{_mm_max_ps(b.v, a.v)}; }
+inline vmask_t operator<(vreal_t a, vreal_t b) { return vmask_t{_mm_cmplt_ps(a.v, b.v)}; }
+inline vmask_t operator<=(vreal_t a, vreal_t b) { return vmask_t{_mm_cmple_ps(a.v, b.v)}; }
+inline vmask_t operator>(vreal_t a, vreal_t b) { return vmask_t{_mm_cmpgt_ps(a.v, b.v)}; }
+inline vmask_t operator>=(vreal_t a, vreal_t b) { return vmask_t{_mm_cmpge_ps(a.v, b.v)}; }
+inline vmask_t operator&(vmask_t a, vmask_t b) { return vmask_t{_mm_and_ps(a.v, b.v)}; }
+inline vmask_t operator|(vmask_t a, vmask_t b) { return vmask_t{_mm_or_ps(a.v, b.v)}; }
+/// a and not b
+inline vmask_t andnot(vmask_t a, vmask_t b) { return vmask_t{_mm_andnot_ps(b.v, a.v)}; }
+inline vmask_t vnone() { return vmask_t{_mm_setzero_ps()}; }
+inline vmask_t vall() { return vmask_t{_mm_castsi128_ps(_mm_set1_epi32(-1))}; }
+/// lanes [0, n) set
+inline vmask_t vlanes(int n) { return vmask_t{_mm_cmplt_ps(_mm_set_ps(3, 2, 1, 0), _mm_set1_ps(float(n)))}; }
+inline vreal_t select(vmask_t m, vreal_t a, vreal_t b) {
+  return vreal_t{_mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v))};
+}
+/// bit i set if lane i is set
+inline int movemask(vmask_t m) { return _mm_movemask_ps(m.v); }
+
+#elif defined(SIMD_SSE)
+
+inline vreal_t vset(real_t r) { return vreal_t{_mm_set1_pd(r)}; }
+inline vreal_t vload(real_t const *p) { return vreal_t{_mm_loadu_pd(p)}; }
+/// SIMD_WIDTH bytes at p, zero extended
+inline vreal_t vload(uint8_t const *p) {
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[0] | (p[1] << 8)), zero);
+  return vreal_t{_mm_cvtepi32_pd(_mm_unpacklo_epi16(words, zero))};
+}
+inline void vstore(real_t *p, vreal_t a) { _mm_storeu_pd(p, a.v); }
+inline vreal_t operator+(vreal_t a, vreal_t b) { return vreal_t{_mm_add_pd(a.v, b.v)}; }
+inline vreal_t operator-(vreal_t a, vreal_t b) { return vreal_t{_mm_sub_pd(a.v, b.v)}; }
+inline vreal_t operator*(vreal_t a, vreal_t b) { return vreal_t{_mm_mul_pd(a.v, b.v)}; }
+inline vreal_t operator/(vreal_t a, vreal_t b) { return vreal_t{_mm_div_pd(a.v, b.v)}; }
+inline vreal_t operator-(vreal_t a) { return vreal_t{_mm_xor_pd(a.v, _mm_set1_pd(-0.0))}; }
+inline vreal_t vsqrt(vreal_t a) { return vreal_t{_mm_sqrt_pd(a.v)}; }
+inline vreal_t vabs(vreal_t a) { return vreal_t{_mm_andnot_pd(_mm_set1_pd(-0.0), a.v)}; }
+// argument order matches std::min/std::max when one side is NaN
+inline vreal_t vmin(vreal_t a, vreal_t b) { return vreal_t{_mm_min_pd(b.v, a.v)}; }
+inline vreal_t vmax(vreal_t a, vreal_t b) { return vreal_t{_mm_max_pd(b.v, a.v)}; }
+inline vmask_t operator<(vreal_t a, vreal_t b) { return vmask_t{_mm_cmplt_pd(a.v, b.v)}; }
+inline vmask_t operator<=(vreal_t a, vreal_t b) { return vmask_t{_mm_cmple_pd(a.v, b.v)}; }
+inline vmask_t operator>(vreal_t a, vreal_t b) { return vmask_t{_mm_cmpgt_pd(a.v, b.v)}; }
+inline vmask_t operator>=(vreal_t a, vreal_t b) { return vmask_t{_mm_cmpge_pd(a.v, b.v)}; }
+inline vmask_t operator&(vmask_t a, vmask_t b) { return vmask_t{_mm_and_pd(a.v, b.v)}; }
+inline vmask_t operator|(vmask_t a, vmask_t b) { return vmask_t{_mm_or_pd(a.v, b.v)}; }
+/// a and not b
+inline vmask_t andnot(vmask_t a, vmask_t b) { return vmask_t{_mm_andnot_pd(b.v, a.v)}; }
+inline vmask_t vnone() { return vmask_t{_mm_setzero_pd()}; }
+inline vmask_t vall() { return vmask_t{_mm_castsi128_pd(_mm_set1_epi32(-1))}; }
+/// lanes [0, n) set
+inline vmask_t vlanes(int n) { return vmask_t{_mm_cmplt_pd(_mm_set_pd(1, 0), _mm_set1_pd(n))}; }
+inline vreal_t select(vmask_t m, vreal_t a, vreal_t b) {
+  return vreal_t{_mm_or_pd(_mm_and_pd(m.v, a.v), _mm_andnot_pd(m.v, b.v))};
+}
+/// bit i set if lane i is set
+inline int movemask(vmask_t m) { return _mm_movemask_pd(m.v); }
+
+#else
+
+inline vreal_t vset(real_t r) { return vreal_t{r}; }
+inline vreal_t vload(real_t const *p) { return vreal_t{*p}; }
+/// SIMD_WIDTH bytes at p, zero extended
+inline vreal_t vload(uint8_t const *p) { return vreal_t{real_t(*p)}; }
+inline void vstore(real_t *p, vreal_t a) { *p = a.v; }
+inline vreal_t operator+(vreal_t a, vreal_t b) { return vreal_t{a.v + b.v}; }
+inline vreal_t operator-(vreal_t a, vreal_t b) { return vreal_t{a.v - b.v}; }
+inline vreal_t operator*(vreal_t a, vreal_t b) { return vreal_t{a.v * b.v}; }
+inline vreal_t operator/(vreal_t a, vreal_t b) { return vreal_t{a.v / b.v}; }
+inline vreal_t operator-(vreal_t a) { return vreal_t{-a.v}; }
+inline vreal_t vsqrt(vreal_t a) { return vreal_t{std::sqrt(a.v)}; }
+inline vreal_t vabs(vreal_t a) { return vreal_t{std::abs(a.v)}; }
+inline vreal_t vmin(vreal_t a, vreal_t b) { return vreal_t{std::min(a.v, b.v)}; }
+inline vreal_t vmax(vreal_t a, vreal_t b) { return vreal_t{std::max(a.v, b.v)}; }
+inline vmask_t operator<(vreal_t a, vreal_t b) { return vmask_t{a.v < b.v}; }
+inline vmask_t operator<=(vreal_t a, vreal_t b) { return vmask_t{a.v <= b.v}; }
+inline vmask_t operator>(vreal_t a, vreal_t b) { return vmask_t{a.v > b.v}; }
+inline vmask_t operator>=(vreal_t a, vreal_t b) { return vmask_t{a.v >= b.v}; }
+inline vmask_t operator&(vmask_t a, vmask_t b) { return vmask_t{a.v && b.v}; }
+inline vmask_t operator|(vmask_t a, vmask_t b) { return vmask_t{a.v || b.v}; }
+/// a and not b
+inline vmask_t andnot(vmask_t a, vmask_t b) { return vmask_t{a.v && !b.v}; }
+inline vmask_t vnone() { return vmask_t{false}; }
+inline vmask_t vall() { return vmask_t{true}; }
+/// lanes [0, n) set
+inline vmask_t vlanes(int n) { return vmask_t{n > 0}; }
+inline vreal_t select(vmask_t m, vreal_t a, vreal_t b) { return m.v ? a : b; }
+/// bit i set if lane i is set
+inline int movemask(vmask_t m) { return m.v ? 1 : 0; }
+
+#endif
@@ -0,0 +1,359 @@
+#include "wide_bvh.h"
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+#include <type_traits>
+
+static const int WIDE_STACK_DEPTH = 64; // levels, each pushes up to N - 1 entries
+
+/// turns the binary node index, and as much of its subtree as fits, into a
+/// wide node. interior children are opened largest surface area first.
+template <int N>
+static int collapseNode(std::vector<bvh_node_t> const &binary, int index,
+                        WideBVH<N> *wide) {
+  int children[N];
+  int count = 0;
+  if (binary[index].count > 0) {
+    children[count++] = index;
+  } else {
+    children[count++] = index + 1;
+    children[count++] = binary[index].offset;
+  }
+  while (count < N) {
+    int    open = -1;
+    real_t largest = real_t(-1);
+    for (int i = 0; i < count; ++i) {
+      bvh_node_t const &child = binary[children[i]];
+      if (child.count == 0 && area(child.bounds) > largest) {
+        largest = area(child.bounds);
+        open = i;
+      }
+    }
+    if (open < 0) {
+      break;
+    }
+    int const second = binary[children[open]].offset;
+    children[open] = children[open] + 1;
+    children[count++] = second;
+  }
+
+  int const at = int(wide->nodes.size());
+  wide->nodes.push_back(wide_node_t<N>());
+  wide_node_t<N> &node = wide->nodes[at];
+  std::fill(node.min_x, node.min_x + wide_node_t<N>::LANES, real_t(0));
+  std::fill(node.min_y, node.min_y + wide_node_t<N>::LANES, real_t(0));
+  std::fill(node.min_z, node.min_z + wide_node_t<N>::LANES, real_t(0));
+  std::fill(node.max_x, node.max_x + wide_node_t<N>::LANES, real_t(0));
+  std::fill(node.max_y, node.max_y + wide_node_t<N>::LANES, real_t(0));
+  std::fill(node.max_z, node.max_z + wide_node_t<N>::LANES, real_t(0));
+  node.count = count;
+  for (int i = 0; i < count; ++i) {
+    aabb_t const &bounds = binary[children[i]].bounds;
+    node.min_x[i] = bounds.min.x;
+    node.min_y[i] = bounds.min.y;
+    node.min_z[i] = bounds.min.z;
+    node.max_x[i] = bounds.max.x;
+    node.max_y[i] = bounds.max.y;
+    node.max_z[i] = bounds.max.z;
+    node.child[i] = ~binary[children[i]].offset;
+  }
+  // the node moves while its subtrees are added
+  for (int i = 0; i < count; ++i) {
+    if (binary[children[i]].count == 0) {
+      int const child = collapseNode(binary, children[i], wide);
+      wide->nodes[at].child[i] = child;
+    }
+  }
+  return at;
+}
+
+template <int N>
+void WideBVH<N>::build(BVH &&binary) {
+  auto const start = std::chrono::high_resolution_clock::now();
+  nodes.clear();
+  leaves = std::move(binary.leaves);
+  soa = std::move(binary.soa);
+  primitives = int(binary.primitives.size());
+  if (!binary.nodes.empty()) {
+    nodes.reserve(binary.nodes.size() / (N - 1) + 1);
+    collapseNode(binary.nodes, 0, this);
+  }
+  binary.nodes.clear();
+  binary.primitives.clear();
+
+  auto const duration = std::chrono::high_resolution_clock::now() - start;
+  build_time = binary.build_time +
+               std::chrono::duration<double, std::milli>(duration).count();
+}
+
+/// the ray in every lane
+struct ray_lanes_t {
+  ray_lanes_t(vec3_t const &origin, vec3_t const &inv_dir)
+      : ox(vset(origin.x)), oy(vset(origin.y)), oz(vset(origin.z)),
+        ix(vset(inv_dir.x)), iy(vset(inv_dir.y)), iz(vset(inv_dir.z)) {}
+
+  vreal_t ox, oy, oz;
+  vreal_t ix, iy, iz;
+};
+
+/// slab test of SIMD_WIDTH boxes, same order of operations as the binary
+/// bvh, NaN from 0*inf included. stores the entry distances to tnear.
+static vmask_t intersectBoxes(ray_lanes_t const &ray, vreal_t min_x, vreal_t min_y,
+                              vreal_t min_z, vreal_t max_x, vreal_t max_y,
+                              vreal_t max_z, real_t tmax, real_t *tnear) {
+  vreal_t const tx0 = (min_x - ray.ox) * ray.ix, tx1 = (max_x - ray.ox) * ray.ix;
+  vreal_t const ty0 = (min_y - ray.oy) * ray.iy, ty1 = (max_y - ray.oy) * ray.iy;
+  vreal_t const tz0 = (min_z - ray.oz) * ray.iz, tz1 = (max_z - ray.oz) * ray.iz;
+  vreal_t t0 = vset(real_t(0));
+  vreal_t t1 = vset(tmax);
+  t0 = vmax(t0, vmin(tx0, tx1));
+  t1 = vmin(t1, vmax(tx0, tx1));
+  t0 = vmax(t0, vmin(ty0, ty1));
+  t1 = vmin(t1, vmax(ty0, ty1));
+  t0 = vmax(t0, vmin(tz0, tz1));
+  t1 = vmin(t1, vmax(tz0, tz1));
+  vstore(tnear, t0);
+  return t0 <= t1;
+}
+
+/// tests the ray against all children of the node at once. returns bit i
+/// set if child i is entered before tmax, with the entry in tnear[i].
+template <int N>
+static int intersectChildren(wide_node_t<N> const &node, ray_lanes_t const &ray,
+                             real_t tmax, real_t *tnear) {
+  int hits = 0;
+  for (int i = 0; i < node.count; i += SIMD_WIDTH) {
+    vmask_t const hit = intersectBoxes(ray, vload(node.min_x + i), vload(node.min_y + i),
+                                       vload(node.min_z + i), vload(node.max_x + i),
+                                       vload(node.max_y + i), vload(node.max_z + i),
+                                       tmax, tnear + i);
+    hits |= movemask(hit & vlanes(node.count - i)) << i;
+  }
+  return hits;
+}
+
+/// closest hit through any of the wide trees, whose nodes differ only in how
+/// intersectChildren() gets at the child boxes
+template <class Tree>
+static bool closestHit(Tree const &tree, ray_t const &ray, real_t tmax,
+                       hit_t *hit, long long *visits) {
+  typedef typename std::remove_reference<decltype(tree.nodes[0])>::type node_t;
+  if (tree.nodes.empty()) {
+    return false;
+  }
+  ray_lanes_t const lanes(ray.origin, vec3_t(real_t(1) / ray.direction.x,
+                                              real_t(1) / ray.direction.y,
+                                              real_t(1) / ray.direction.z));
+  bool found = false;
+
+  struct entry_t {
+    int    child;
+    real_t tnear;
+  } stack[WIDE_STACK_DEPTH * (Tree::WIDTH - 1) + 1];
+  int       top = 0;
+  long long visited = 0;
+  stack[top++] = entry_t{0, real_t(0)};
+  while (top > 0) {
+    entry_t const entry = stack[--top];
+    if (entry.tnear >= tmax) {
+      continue;
+    }
+    if (entry.child < 0) {
+      if (tree.soa.intersect(tree.leaves[~entry.child].range, ray, tmax, hit)) {
+        tmax = hit->t;
+        found = true;
+      }
+      continue;
+    }
+    node_t const &node = tree.nodes[entry.child];
+    real_t tnear[wide_node_t<Tree::WIDTH>::LANES];
+    int const hits = intersectChildren(node, lanes, tmax, tnear);
+    visited += node.count;
+    // push the hit children farthest first so the nearest is visited next
+    int const bottom = top;
+    for (int i = 0; i < node.count; ++i) {
+      if (!(hits & (1 << i))) {
+        continue;
+      }
+      entry_t const child = {node.child[i], tnear[i]};
+      int j = top++;
+      for (; j > bottom && stack[j - 1].tnear < child.tnear; --j) {
+        stack[j] = stack[j - 1];
+      }
+      stack[j] = child;
+    }
+  }
+  if (visits) {
+    *visits += visited;
+  }
+  return found;
+}
+
+template <class Tree>
+static bool anyHit(Tree const &tree, ray_t const &ray, real_t tmin, real_t tmax) {
+  typedef typename std::remove_reference<decltype(tree.nodes[0])>::type node_t;
+  if (tree.nodes.empty()) {
+    return false;
+  }
+  ray_lanes_t const lanes(ray.origin, vec3_t(real_t(1) / ray.direction.x,
+                                              real_t(1) / ray.direction.y,
+                                              real_t(1) / ray.direction.z));
+  int stack[WIDE_STACK_DEPTH * (Tree::WIDTH - 1) + 1];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    int const child = stack[--top];
+    if (child < 0) {
+      if (tree.soa.occluded(tree.leaves[~child].range, ray, tmin, tmax)) {
+        return true;
+      }
+      continue;
+    }
+    node_t const &node = tree.nodes[child];
+    real_t tnear[wide_node_t<Tree::WIDTH>::LANES];
+    int const hits = intersectChildren(node, lanes, tmax, tnear);
+    for (int i = 0; i < node.count; ++i) {
+      if (hits & (1 << i)) {
+        stack[top++] = node.child[i];
+      }
+    }
+  }
+  return false;
+}
+
+template <int N>
+bool WideBVH<N>::intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                           long long *visits) const {
+  return closestHit(*this, ray, tmax, hit, visits);
+}
+
+template <int N>
+bool WideBVH<N>::occluded(ray_t const &ray, real_t tmin, real_t tmax) const {
+  return anyHit(*this, ray, tmin, tmax);
+}
+
+/// 2^e for e in [-126, 127], straight from the bits of a float
+static real_t powerOfTwo(int e) {
+  uint32_t const bits = uint32_t(e + 127) << 23;
+  float          f;
+  memcpy(&f, &bits, sizeof(f));
+  return real_t(f);
+}
+
+/// the one place quantized coordinates turn back into reals, both for
+/// traversal and for checking the rounding while building
+static real_t dequantize(float origin, real_t scale, int q) {
+  return real_t(origin) + real_t(q) * scale;
+}
+
+/// quantizes the child boxes of node. picks the finest grid over the node
+/// that 8 bits cover, then rounds every coordinate outwards until the
+/// dequantized box holds the original one.
+template <int N>
+static void quantizeNode(wide_node_t<N> const &node, quantized_node_t<N> *q) {
+  memset(q, 0, sizeof(*q));
+  q->count = uint8_t(node.count);
+  real_t const *mins[3] = {node.min_x, node.min_y, node.min_z};
+  real_t const *maxs[3] = {node.max_x, node.max_y, node.max_z};
+  uint8_t      *los[3] = {q->lo_x, q->lo_y, q->lo_z};
+  uint8_t      *his[3] = {q->hi_x, q->hi_y, q->hi_z};
+  for (int a = 0; a < 3; ++a) {
+    real_t lo = mins[a][0], hi = maxs[a][0];
+    for (int i = 1; i < node.count; ++i) {
+      lo = std::min(lo, mins[a][i]);
+      hi = std::max(hi, maxs[a][i]);
+    }
+    float origin = float(lo);
+    if (real_t(origin) > lo) {
+      origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+    }
+    int exponent = -126;
+    if (hi - real_t(origin) > real_t(0)) {
+      std::frexp((hi - real_t(origin)) / real_t(255), &exponent);
+      exponent = clamp(exponent, -126, 127);
+    }
+    while (exponent < 127 && dequantize(origin, powerOfTwo(exponent), 255) < hi) {
+      ++exponent;
+    }
+    real_t const scale = powerOfTwo(exponent);
+    q->origin[a] = origin;
+    q->exponent[a] = int8_t(exponent);
+    for (int i = 0; i < node.count; ++i) {
+      int l = int(clamp(std::floor((mins[a][i] - real_t(origin)) / scale), real_t(0), real_t(255)));
+      int h = int(clamp(std::ceil((maxs[a][i] - real_t(origin)) / scale), real_t(0), real_t(255)));
+      while (l > 0 && dequantize(origin, scale, l) > mins[a][i]) {
+        --l;
+      }
+      while (h < 255 && dequantize(origin, scale, h) < maxs[a][i]) {
+        ++h;
+      }
+      los[a][i] = uint8_t(l);
+      his[a][i] = uint8_t(h);
+    }
+  }
+  for (int i = 0; i < node.count; ++i) {
+    q->child[i] = node.child[i];
+  }
+}
+
+/// dequantizes the child boxes a register at a time and tests them like the
+/// wide bvh does
+template <int N>
+static int intersectChildren(quantized_node_t<N> const &node, ray_lanes_t const &ray,
+                             real_t tmax, real_t *tnear) {
+  vreal_t const origin_x = vset(real_t(node.origin[0]));
+  vreal_t const origin_y = vset(real_t(node.origin[1]));
+  vreal_t const origin_z = vset(real_t(node.origin[2]));
+  vreal_t const scale_x = vset(powerOfTwo(node.exponent[0]));
+  vreal_t const scale_y = vset(powerOfTwo(node.exponent[1]));
+  vreal_t const scale_z = vset(powerOfTwo(node.exponent[2]));
+  int hits = 0;
+  for (int i = 0; i < node.count; i += SIMD_WIDTH) {
+    // the same operations as dequantize()
+    vmask_t const hit = intersectBoxes(ray, origin_x + vload(node.lo_x + i) * scale_x,
+                                       origin_y + vload(node.lo_y + i) * scale_y,
+                                       origin_z + vload(node.lo_z + i) * scale_z,
+                                       origin_x + vload(node.hi_x + i) * scale_x,
+                                       origin_y + vload(node.hi_y + i) * scale_y,
+                                       origin_z + vload(node.hi_z + i) * scale_z,
+                                       tmax, tnear + i);
+    hits |= movemask(hit & vlanes(node.count - i)) << i;
+  }
+  return hits;
+}
+
+template <int N>
+void QuantizedBVH<N>::build(WideBVH<N> &&wide) {
+  auto const start = std::chrono::high_resolution_clock::now();
+  nodes.resize(wide.nodes.size());
+  for (size_t i = 0; i < wide.nodes.size(); ++i) {
+    quantizeNode(wide.nodes[i], &nodes[i]);
+  }
+  leaves = std::move(wide.leaves);
+  soa = std::move(wide.soa);
+  primitives = wide.primitives;
+  wide.nodes.clear();
+
+  auto const duration = std::chrono::high_resolution_clock::now() - start;
+  build_time = wide.build_time +
+               std::chrono::duration<double, std::milli>(duration).count();
+}
+
+template <int N>
+bool QuantizedBVH<N>::intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                                long long *visits) const {
+  return closestHit(*this, ray, tmax, hit, visits);
+}
+
+template <int N>
+bool QuantizedBVH<N>::occluded(ray_t const &ray, real_t tmin, real_t tmax) const {
+  return anyHit(*this, ray, tmin, tmax);
+}
+
+static_assert(sizeof(quantized_node_t<4>) == 64, "4 children fill one cache line");
+static_assert(sizeof(quantized_node_t<8>) == 128, "8 children fill two cache lines");
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+template class QuantizedBVH<4>;
+template class QuantizedBVH<8>;
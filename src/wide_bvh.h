@@ -0,0 +1,110 @@
+#pragma once
+#include "bvh.h"
+#include "simd.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+/// node of a WideBVH. the child boxes are stored as structure of arrays,
+/// padded to whole SIMD registers, so one slab test covers all children.
+template <int N>
+struct wide_node_t {
+  static const int LANES = (N + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+
+  real_t min_x[LANES], min_y[LANES], min_z[LANES];
+  real_t max_x[LANES], max_y[LANES], max_z[LANES];
+  int    child[N]; // interior: index of the node, leaf: ~index into leaves
+  int    count;    // children in use, the rest are never hit
+};
+
+/// bvh with up to N children per node, collapsed from a binary BVH by
+/// repeatedly opening the child with the largest surface area. tested a node
+/// at a time, nearest child first; the leaves and their compiled arrays are
+/// taken over from the binary tree, so the closest hits are the same.
+template <int N>
+class WideBVH {
+public:
+  static const int WIDTH = N;
+
+  /// collapses binary, which is left empty
+  void build(BVH &&binary);
+  /// finds the closest hit closer than tmax, hit is untouched on a miss.
+  /// adds the number of child boxes tested to visits if given.
+  bool intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                 long long *visits = nullptr) const;
+  /// any hit in [tmin, tmax], stops at the first one found
+  bool occluded(ray_t const &ray, real_t tmin, real_t tmax) const;
+
+  std::vector<wide_node_t<N>> nodes;
+  std::vector<bvh_leaf_t>     leaves;
+  GeometrySoA                 soa;
+  int                         primitives = 0; // references, those of the leaves
+  double                      build_time = 0; // milliseconds, binary build included
+};
+
+/// std::vector allocator for over aligned types, plain new only respects
+/// their alignment from c++17 on
+template <class T>
+struct aligned_allocator_t {
+  typedef T value_type;
+
+  aligned_allocator_t() = default;
+  template <class U>
+  aligned_allocator_t(aligned_allocator_t<U> const &) {}
+
+  T *allocate(size_t n) {
+    // the block malloc returned is kept right in front of the aligned one
+    void *const block = malloc(n * sizeof(T) + alignof(T) + sizeof(void *));
+    if (!block) {
+      throw std::bad_alloc();
+    }
+    uintptr_t const aligned =
+        (uintptr_t(block) + sizeof(void *) + alignof(T) - 1) & ~uintptr_t(alignof(T) - 1);
+    reinterpret_cast<void **>(aligned)[-1] = block;
+    return reinterpret_cast<T *>(aligned);
+  }
+  void deallocate(T *p, size_t) { free(reinterpret_cast<void **>(p)[-1]); }
+};
+
+template <class T, class U>
+bool operator==(aligned_allocator_t<T> const &, aligned_allocator_t<U> const &) { return true; }
+template <class T, class U>
+bool operator!=(aligned_allocator_t<T> const &, aligned_allocator_t<U> const &) { return false; }
+
+/// node of a QuantizedBVH, one cache line for 4 children and two for 8.
+/// child boxes are 8 bit coordinates on a grid over the node: a coordinate q
+/// on axis a lies at origin[a] + q * 2^exponent[a]. lower corners are rounded
+/// down and upper ones up, so the boxes only grow.
+template <int N>
+struct alignas(64) quantized_node_t {
+  float   origin[3];
+  int8_t  exponent[3];
+  uint8_t count; // children in use
+  uint8_t lo_x[N], lo_y[N], lo_z[N];
+  uint8_t hi_x[N], hi_y[N], hi_z[N];
+  int     child[N]; // interior: index of the node, leaf: ~index into leaves
+};
+
+/// WideBVH with quantized nodes, for scenes whose hierarchy outgrows the
+/// caches. nodes keep the depth first order of the wide bvh, so the first
+/// interior child of a node is the line right after it.
+template <int N>
+class QuantizedBVH {
+public:
+  static const int WIDTH = N;
+
+  /// quantizes wide, which is left empty
+  void build(WideBVH<N> &&wide);
+  /// finds the closest hit closer than tmax, hit is untouched on a miss.
+  /// adds the number of child boxes tested to visits if given.
+  bool intersect(ray_t const &ray, real_t tmax, hit_t *hit,
+                 long long *visits = nullptr) const;
+  /// any hit in [tmin, tmax], stops at the first one found
+  bool occluded(ray_t const &ray, real_t tmin, real_t tmax) const;
+
+  std::vector<quantized_node_t<N>, aligned_allocator_t<quantized_node_t<N>>> nodes;
+  std::vector<bvh_leaf_t> leaves;
+  GeometrySoA             soa;
+  int                     primitives = 0; // references, those of the leaves
+  double                  build_time = 0; // milliseconds, wide build included
+};
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""writes scenes of n similar sized spheres and boxes scattered over a floor,
+for comparing the acceleration structures, see readme.md, benchmarks.
+
+    spheres.py 10000 > spheres-10000.xml
+    spheres.py --bench path/to/simple-pt 1000 10000 100000
+
+the objects shrink as their number grows, so every scene fills the same
+volume about equally. --bars adds long thin boxes in random orientations,
+whose bounds take in many of the other objects. --bench renders every count
+with every structure and prints a table of build and render times. lbvh and
+sbvh stand for the bvh with --bvh-build=lbvh or sbvh.
+"""
+import argparse
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+MATERIALS = """\
+    <material name="light" color="4 4 4" roughness="1" emit="true" />
+    <material name="floor" color="0.8 0.8 0.8" roughness="1" />
+    <material name="red" color="1 0.3 0.3" roughness="1" />
+    <material name="green" color="0.3 1 0.3" roughness="0.4" />
+    <material name="blue" color="0.3 0.3 1" roughness="0.1" />
+    <material name="white" color="0.9 0.9 0.9" roughness="0.7" />
+"""
+
+
+def rotation(rng):
+    """axes of a uniformly random rotation, from a random unit quaternion"""
+    w, x, y, z = (rng.gauss(0, 1) for _ in range(4))
+    n = (w * w + x * x + y * y + z * z) ** 0.5
+    w, x, y, z = w / n, x / n, y / n, z / n
+    return [(1 - 2 * (y * y + z * z), 2 * (x * y + w * z), 2 * (x * z - w * y)),
+            (2 * (x * y - w * z), 1 - 2 * (x * x + z * z), 2 * (y * z + w * x)),
+            (2 * (x * z + w * y), 2 * (y * z - w * x), 1 - 2 * (x * x + y * y))]
+
+
+def scene(count, seed=1, bars=0):
+    rng = random.Random(seed)
+    size = 0.25 * (1000.0 / count) ** (1.0 / 3.0)
+    lines = ["<scene>", MATERIALS]
+    for _ in range(count):
+        x, y, z = rng.uniform(-8, 8), rng.uniform(0, 6), rng.uniform(2, 20)
+        r = size * rng.uniform(0.8, 1.2)
+        material = rng.choice(["red", "green", "blue", "white"])
+        if rng.random() < 0.75:
+            lines.append('    <geometry type="sphere" material="%s" center="%.4f %.4f %.4f" radius="%.4f" />'
+                         % (material, x, y, z, r))
+        else:
+            lines.append('    <geometry type="orb" material="%s" center="%.4f %.4f %.4f" extent="%.4f %.4f %.4f"'
+                         ' x-axis="1 0 0" y-axis="0 1 0" z-axis="0 0 1" />'
+                         % (material, x, y, z, r, r, r))
+    for _ in range(bars):
+        x, y, z = rng.uniform(-8, 8), rng.uniform(0, 6), rng.uniform(2, 20)
+        axes = rotation(rng)
+        lines.append('    <geometry type="orb" material="white" center="%.4f %.4f %.4f" extent="4 0.03 0.03"'
+                     ' x-axis="%.6f %.6f %.6f" y-axis="%.6f %.6f %.6f" z-axis="%.6f %.6f %.6f" />'
+                     % ((x, y, z) + axes[0] + axes[1] + axes[2]))
+    lines.append('    <geometry type="sphere" material="light" center="-3 9 8" radius="1.5" />')
+    lines.append('    <geometry type="sphere" material="light" center="4 9 14" radius="1.5" />')
+    lines.append('    <geometry type="plane" material="floor" center="0 0 0" normal="0 1 0" />')
+    lines.append('    <camera position="0 3 -4" direction="0 0 1" up="0 1 0" fov="1.2" near="0.1" far="1000" />')
+    lines.append("</scene>")
+    return "\n".join(lines) + "\n"
+
+
+def bench(exe, counts, accels, extra, bars):
+    print("| objects | accel | build ms | render s |")
+    print("|---------|-------|----------|----------|")
+    with tempfile.TemporaryDirectory() as tmp:
+        for count in counts:
+            path = os.path.join(tmp, "spheres-%d.xml" % count)
+            with open(path, "w") as f:
+                f.write(scene(count, bars=bars))
+            for accel in accels:
+                start = time.time()
+                flags = ["--accel", "bvh", "--bvh-build", accel] if accel in ("lbvh", "sbvh") else ["--accel", accel]
+                out = subprocess.run([exe, path, "-o", os.path.join(tmp, "out.ppm")] + flags + extra,
+                                     stdout=subprocess.PIPE, universal_newlines=True).stdout
+                seconds = time.time() - start
+                built = re.search(r"built in ([0-9.]+)ms", out)
+                print("| %7d | %-5s | %8s | %8.2f |" % (count, accel, built.group(1) if built else "-", seconds))
+                sys.stdout.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("counts", type=int, nargs="+")
+    parser.add_argument("--bench", metavar="EXE", help="render the scenes with EXE instead of printing them")
+    parser.add_argument("--bars", type=int, default=0, help="long thin boxes to add [default: 0]")
+    parser.add_argument("--accels", default="bvh,grid", help="structures to compare, of bvh, bvh4, bvh8, bvh4q, bvh8q, lbvh, sbvh, lazy, grid and none [default: bvh,grid]")
+    parser.add_argument("--args", default="-w 160 -h 100 -s 4 -t 1",
+                        help="further simple-pt arguments [default: -w 160 -h 100 -s 4 -t 1]")
+    args = parser.parse_args()
+    if args.bench:
+        bench(args.bench, args.counts, args.accels.split(","), args.args.split(), args.bars)
+    else:
+        for count in args.counts:
+            sys.stdout.write(scene(count, bars=args.bars))
+
+
+if __name__ == "__main__":
+    main()